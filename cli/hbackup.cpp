@@ -62,6 +62,10 @@ static void show_help(void) {
   cout << " -v or --verbose  to be more verbose (also -vv and -vvv)" << endl;
   cout << " -C or --client   specify client to backup (more than one allowed)"
     << endl;
+  cout << " -D or --daemon   to keep backing up changes of local clients every \
+given number of seconds" << endl;
+  cout << " -w or --window   to stop backing up after given number of minutes, \
+next backup resuming there" << endl;
 }
 
 int hbackup::verbosity(void) {
@@ -89,6 +93,10 @@ int main(int argc, char **argv) {
   bool              config_check      = false;
   bool              expect_configpath = false;
   bool              expect_client     = false;
+  bool              expect_interval   = false;
+  int               interval          = 0;
+  bool              expect_window     = false;
+  int               window            = 0;
   struct sigaction  action;
   HBackup           hbackup;
 
@@ -116,12 +124,34 @@ int main(int argc, char **argv) {
       expect_client = false;
     }
 
+    /* Get daemon interval if request */
+    if (expect_interval) {
+      if ((sscanf(argv[argn], "%d", &interval) != 1) || (interval <= 0)) {
+        cerr << "Wrong daemon interval: " << argv[argn] << endl;
+        return 2;
+      }
+      expect_interval = false;
+      continue;
+    }
+
+    /* Get backup window if request */
+    if (expect_window) {
+      if ((sscanf(argv[argn], "%d", &window) != 1) || (window <= 0)) {
+        cerr << "Wrong backup window: " << argv[argn] << endl;
+        return 2;
+      }
+      expect_window = false;
+      continue;
+    }
+
     /* -* */
     if (argv[argn][0] == '-') {
       /* --* */
       if (argv[argn][1] == '-') {
         if (! strcmp(&argv[argn][2], "config")) {
           letter = 'c';
+        } else if (! strcmp(&argv[argn][2], "daemon")) {
+          letter = 'D';
         } else if (! strcmp(&argv[argn][2], "debug")) {
           letter = 'd';
         } else if (! strcmp(&argv[argn][2], "help")) {
@@ -138,6 +168,8 @@ int main(int argc, char **argv) {
           letter = 'v';
         } else if (! strcmp(&argv[argn][2], "client")) {
           letter = 'C';
+        } else if (! strcmp(&argv[argn][2], "window")) {
+          letter = 'w';
         } else if (! strcmp(&argv[argn][2], "version")) {
           letter = 'V';
         }
@@ -185,6 +217,12 @@ int main(int argc, char **argv) {
         case 'C':
           expect_client = true;
           break;
+        case 'D':
+          expect_interval = true;
+          break;
+        case 'w':
+          expect_window = true;
+          break;
         case 'V':
           show_version();
           return 0;
@@ -200,6 +238,16 @@ int main(int argc, char **argv) {
     return 2;
   }
 
+  if (expect_interval) {
+    cerr << "Missing daemon interval" << endl;
+    return 2;
+  }
+
+  if (expect_window) {
+    cerr << "Missing backup window" << endl;
+    return 2;
+  }
+
   if (config_path == "") {
     config_path = default_config_path;
   }
@@ -226,12 +274,21 @@ int main(int argc, char **argv) {
       return 3;
     }
   } else
+  // Backup changes as they come
+  if (interval != 0) {
+    if (hbackup::verbosity() > 0) {
+      cout << "Watching" << endl;
+    }
+    if (hbackup.daemon(interval)) {
+      return 3;
+    }
+  } else
   // Backup
   {
     if (hbackup::verbosity() > 0) {
       cout << "Backing up" << endl;
     }
-    if (hbackup.backup()) {
+    if (hbackup.backup(false, (window != 0) ? time(NULL) + window * 60 : 0)) {
       return 3;
     }
   }
@@ -19,6 +19,7 @@
 #include <fstream>
 #include <iostream>
 #include <list>
+#include <vector>
 #include <string>
 #include <errno.h>
 
@@ -267,6 +268,9 @@ int Client::readListFile(const string& list_path) {
               }
             }
           } else
+          if (keyword == "locality") {
+            path->setLocality();
+          } else
           if (keyword == "expire") {
             int time_out;
             if ((sscanf(type.c_str(), "%d", &time_out) != 0)
@@ -301,6 +305,14 @@ Client::Client(string value) {
   _mount_point  = "";
   _mounted      = "";
   _initialised  = false;
+  _concurrency  = 0;
+  _watch        = false;
+  _budget       = 0;
+  _deadline     = 0;
+  _paths        = 0;
+  _paths_done   = 0;
+  _nodes        = 0;
+  _stopped      = false;
 
   if (verbosity() > 2) {
     cout << " --> Client: " << _name << endl;
@@ -336,6 +348,10 @@ int Client::backup(
   string  share;
   string  list_path;
 
+  _paths      = 0;
+  _paths_done = 0;
+  _nodes      = 0;
+  _stopped    = false;
   if (mountPath(_listfile.dirname().c_str(), &list_path)) {
     switch (errno) {
       case EPROTONOSUPPORT:
@@ -360,14 +376,16 @@ int Client::backup(
       << "' using protocol '" << _protocol << "'" << endl;
   }
 
-  if (! readListFile(list_path)) {
+  // When watching, the list is only read once
+  if ((_watch && ! _d->paths.empty()) || ! readListFile(list_path)) {
     setInitialised();
+    _paths = _d->paths.size();
     /* Backup */
     if (_d->paths.empty()) {
       failed = 1;
     } else if (! config_check) {
       for (list<Path*>::iterator i = _d->paths.begin(); i != _d->paths.end(); i++) {
-        if (terminating() || clientfailed) {
+        if (terminating() || clientfailed || _stopped) {
           break;
         }
         string  backup_path;
@@ -376,19 +394,52 @@ int Client::backup(
           cout << "Backup path '" << (*i)->path() << "'" << endl;
         }
 
+        if (_concurrency > 0) {
+          (*i)->setConcurrency(_concurrency);
+        }
+        // Walked all through by an interrupted run
+        string done;
+        if (! _watch
+         && (db.getProgress(prefix().c_str(), (*i)->path(), done) > 0)
+         && done.empty()) {
+          if (verbosity() > 1) {
+            cout << " -> Already backed up by interrupted run" << endl;
+          }
+          _paths_done++;
+          continue;
+        }
+        (*i)->setDeadline(_deadline);
         if (mountPath((*i)->path(), &backup_path)) {
           cerr << "clients: backup: mount failed for " << (*i)->path() << endl;
           failed = 1;
         } else
-        if ((*i)->parse(db, prefix().c_str(), backup_path.c_str())) {
-          // prepare_share sets errno
-          if (! terminating()) {
-            cerr << "clients: backup: list creation failed" << endl;
+        if ((*i)->parse(db, prefix().c_str(), backup_path.c_str(),
+            _watch && (_protocol == "file"))) {
+          _nodes += (*i)->nodes();
+          if (errno == ETIMEDOUT) {
+            // Next run resumes there
+            if (verbosity() > 0) {
+              cout << "Time budget spent for client '" << _name << "'"
+                << endl;
+            }
+            _stopped = true;
+          } else {
+            // prepare_share sets errno
+            if (! terminating()) {
+              cerr << "clients: backup: list creation failed" << endl;
+            }
+            failed        = 1;
+            clientfailed  = 1;
           }
-          failed        = 1;
-          clientfailed  = 1;
+        } else {
+          _nodes += (*i)->nodes();
+          _paths_done++;
         }
       }
+      // Only a run cut short leaves paths for the next one to skip
+      if (! terminating() && ! _stopped) {
+        db.clearProgress(prefix().c_str());
+      }
     }
   } else {
     // errno set by functions called
@@ -399,6 +450,12 @@ int Client::backup(
       case EUCLEAN:
         cerr << "List file corrupted " << list_path << endl;
     }
+    // Read it again next time
+    for (list<Path*>::iterator i = _d->paths.begin(); i != _d->paths.end();
+        i++) {
+      delete *i;
+    }
+    _d->paths.clear();
     failed = 1;
   }
   umount(); // does not change errno
@@ -417,6 +474,9 @@ void Client::show() {
     }
     cout << endl;
   }
+  if (_concurrency > 0) {
+    cout << "Concurrency: " << _concurrency << endl;
+  }
   if (_d->paths.size() > 0) {
     cout << "Paths:" << endl;
     for (list<Path*>::iterator i = _d->paths.begin(); i != _d->paths.end(); i++) {
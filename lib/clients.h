@@ -45,6 +45,15 @@ class Client {
   StrPath       _listfile;
   string        _protocol;
   list<Option>  _options;
+  int           _concurrency;   // metadata requests at once (0: default)
+  bool          _watch;         // keep paths watched between backups
+  int           _budget;        // time allowed per backup, in seconds (0: any)
+  time_t        _deadline;      // stop backup then (0: never)
+  // Coverage of last backup
+  int           _paths;
+  int           _paths_done;
+  int           _nodes;
+  bool          _stopped;       // at deadline
   //
   bool          _initialised;
   string        _mount_point;
@@ -57,6 +66,7 @@ public:
   ~Client();
   string prefix() const { return _protocol + "://" + _name; }
   string name() const   { return _name; }
+  string protocol() const { return _protocol; }
   void addOption(const string& value) {
     _options.push_back(Option("", value));
   }
@@ -66,6 +76,13 @@ public:
   void setHostOrIp(string value);
   void setProtocol(string value);
   void setListfile(const char* value);
+  void setConcurrency(int value) { _concurrency = value; }
+  // Only back up what changed since last backup (file protocol only)
+  void setWatch(bool watch = true) { _watch = watch; }
+  void setBudget(int seconds) { _budget = seconds; }
+  int  budget() const { return _budget; }
+  // Stop cleanly at given time, next backup resuming there (0: never)
+  void setDeadline(time_t deadline) { _deadline = deadline; }
   //
   bool initialised() const { return _initialised; }
   void setInitialised() { _initialised = true; }
@@ -74,6 +91,11 @@ public:
   }
   string mountPoint() { return _mount_point; }
   int  backup(Database& db, bool config_check = false);
+  // Coverage of last backup
+  int  paths() const     { return _paths;      }
+  int  pathsDone() const { return _paths_done; }
+  int  nodes() const     { return _nodes;      }
+  bool stopped() const   { return _stopped;    }
   void show();
 };
 
@@ -38,11 +38,15 @@
 #include <sstream>
 #include <string>
 #include <list>
+#include <vector>
+#include <map>
 #include <sys/stat.h>
 #include <signal.h>
 #include <time.h>
 #include <dirent.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 
 using namespace std;
 
@@ -55,13 +59,147 @@ using namespace std;
 
 using namespace hbackup;
 
+// Lists are compressed in blocks, the journal in smaller ones as a crash
+// loses its last unfinished block
+static const unsigned int list_compression   = 5;
+static const size_t       journal_block_size = 16384;
+
+// Journals are kept as sorted segments, and only folded into the active list
+// when there are too many of them, or when they get big compared to it
+static const int          max_segments       = 16;
+static const int          segments_ratio     = 4;
+
+// Folded segments are kept as history, only merged into the list (which holds
+// all versions of all files) when there are too many of them
+static const int          max_history        = 8;
+
+// Each client prefix has its own partition: a directory holding its list,
+// history, active list, journal and segments. Up to max_merges partitions are
+// merged at once.
+static const int          max_merges         = 4;
+
+struct Database::Partition {
+  StrPath           prefix;
+  string            name;         // directory name, in lists
+  string            path;
+  int               segments;     // journal segments left by previous runs
+  int               history;      // history segments not in list yet
+  List*             journal;      // opened when first written to
+  int               rc;           // merge result
+  bool              opened;       // list checked, journal recovered
+};
+
 struct Database::Private {
-  DbList::iterator  entry;
   DbList            active;
-  List*             list;
-  List*             journal;
+  list<Partition>   partitions;   // sorted by prefix
+  Partition*        last;         // last partition looked up
+  Partition*        loaded;       // partition in active list
+  DbVersions        versions;
+  Partition*        versioned;    // partition in versions
+  pthread_mutex_t   data_lock;    // placing of written data
 };
 
+// Segments are numbered from 1, oldest first
+static string segment(int number) {
+  stringstream ss;
+  ss << "journal." << number;
+  return ss.str();
+}
+
+static string history(int number) {
+  stringstream ss;
+  ss << "history." << number;
+  return ss.str();
+}
+
+// Merge numbered segments into one, named after the first if alone
+static int mergeSegments(
+    const string& dir,
+    int           count,
+    string        (*name)(int),
+    const char*   all_name,
+    string&       merged_name) {
+  const char* path   = dir.c_str();
+  bool        failed = false;
+
+  merged_name = name(1);
+  for (int i = 2; (i <= count) && ! failed; i++) {
+    List older(path, merged_name.c_str());
+    List newer(path, name(i).c_str());
+    List merged(path, "segments.part");
+    if (older.open("r") || newer.open("r")
+     || merged.open("w", list_compression, journal_block_size)) {
+      cerr << strerror(errno) << ": failed to open segments" << endl;
+      failed = true;
+    } else
+    if (merged.merge(older, newer)) {
+      cerr << "db: close: segments merge failed" << endl;
+      failed = true;
+    }
+    older.close();
+    newer.close();
+    merged.close();
+    if (! failed && rename((dir + "/segments.part").c_str(),
+        (dir + "/" + all_name).c_str())) {
+      cerr << "db: close: cannot rename segments" << endl;
+      failed = true;
+    }
+    merged_name = all_name;
+  }
+  return failed ? -1 : 0;
+}
+
+// Write active records of list
+static int makeActive(
+    const string& dir,
+    const char*   list_name,
+    const char*   journal_name = NULL) {
+  const char* path   = dir.c_str();
+  bool        failed = false;
+  List        list(path, list_name);
+  List        active(path, "active.part");
+
+  if (list.open("r") || active.open("w", list_compression)) {
+    cerr << strerror(errno) << ": failed to open active lists" << endl;
+    failed = true;
+  } else {
+    active.setActiveOnly();
+    if (journal_name != NULL) {
+      List journal(path, journal_name);
+      if (journal.open("r") || active.merge(list, journal)) {
+        failed = true;
+      }
+      journal.close();
+    } else {
+      String prefix;
+      int    rc;
+      while ((rc = list.nextPrefix(prefix)) > 0) {
+        if (active.copyPrefix(list)) {
+          rc = -1;
+          break;
+        }
+      }
+      if (rc < 0) {
+        failed = true;
+      }
+    }
+  }
+  list.close();
+  if (active.close()) {
+    failed = true;
+  }
+  if (! failed && rename((dir + "/active.part").c_str(),
+      (dir + "/active").c_str())) {
+    failed = true;
+  }
+  if (failed) {
+    cerr << "db: cannot write active list" << endl;
+    std::remove((dir + "/active.part").c_str());
+    return -1;
+  }
+  return 0;
+}
+
 int Database::organise(const string& path, int number) {
   DIR           *directory;
   struct dirent *dir_entry;
@@ -123,10 +261,123 @@ int Database::organise(const string& path, int number) {
   return failed;
 }
 
+// Files this large are copied in steps, each synced to disk then noted down,
+// so an interrupted copy can go on from the last step
+static const long long resume_size = 64 << 20;
+static const long long resume_step = 64 << 20;
+// Partial copies of files that went away are eventually removed
+static const time_t    partial_expiry = 7 * 24 * 3600;
+
+// Partial copies are named after their source
+static string partialName(const string& path) {
+  // FNV-1a
+  unsigned long long hash = 14695981039346656037ULL;
+  for (const char* c = path.c_str(); *c != '\0'; c++) {
+    hash ^= (unsigned char) *c;
+    hash *= 1099511628211ULL;
+  }
+  char name[32];
+  sprintf(name, "partial.%016llx", hash);
+  return name;
+}
+
+// Step file line: source size, mtime and path, tab-separated, then length
+// copied on its own line
+static int copyResumable(
+    Stream&         source,
+    const string&   path,
+    const string&   temp_path) {
+  if (terminating()) {
+    errno = EINTR;
+    return -1;
+  }
+  string    step_path = temp_path + ".from";
+  char*     source_id = NULL;
+  long long copied    = 0;
+  asprintf(&source_id, "%lld\t%ld\t%s\n", source.size(), source.mtime(),
+    path.c_str());
+
+  // Previous copy of the same file
+  Stream step(step_path.c_str());
+  if (step.isValid() && ! step.open("r")) {
+    String line;
+    if ((step.getLine(line) > 0) && (strcmp(line.c_str(), source_id) == 0)
+     && (step.getLine(line) > 0)
+     && (sscanf(line.c_str(), "%lld", &copied) != 1)) {
+      copied = 0;
+    }
+    step.close();
+  }
+  // Drop data that may not have reached the disk
+  if ((copied > 0) && truncate64(temp_path.c_str(), copied)) {
+    copied = 0;
+  }
+  if (copied > 0) {
+    Stream partial(temp_path.c_str());
+    if (partial.open("r") || source.resume(partial)) {
+      // Next time will start over
+      std::remove(step_path.c_str());
+      free(source_id);
+      return -1;
+    }
+    partial.close();
+    if (verbosity() > 2) {
+      cout << " --> Resuming copy of " << path << " after " << copied
+        << " bytes" << endl;
+    }
+  }
+
+  Stream temp(temp_path.c_str());
+  if (temp.open((copied > 0) ? "a" : "w")) {
+    cerr << strerror(errno) << ": " << temp_path << endl;
+    free(source_id);
+    return -1;
+  }
+  unsigned char buffer[Stream::chunk];
+  long long     synced = copied;
+  bool          eof    = false;
+  int           rc     = 0;
+  do {
+    if (terminating()) {
+      errno = EINTR;
+      rc    = -1;
+      break;
+    }
+    ssize_t size = source.read(buffer, Stream::chunk);
+    if ((size < 0) || (temp.write(buffer, size) < 0)) {
+      rc = -1;
+      break;
+    }
+    eof     = (size == 0);
+    copied += size;
+    if ((copied - synced >= resume_step) && ! temp.sync()) {
+      stringstream ss;
+      ss << source_id << copied << "\n";
+      Stream next((step_path + ".part").c_str());
+      if (! next.open("w")) {
+        next.write(ss.str().c_str(), ss.str().length());
+        if (! next.close()) {
+          rename((step_path + ".part").c_str(), step_path.c_str());
+        }
+      }
+      synced = copied;
+    }
+  } while (! eof);
+  temp.close();
+  free(source_id);
+
+  // Keep partial copy if interrupted
+  if ((rc == 0) || (errno != EINTR)) {
+    std::remove(step_path.c_str());
+  }
+  return rc;
+}
+
 int Database::write(
     const string&   path,
     char**          dchecksum,
-    int             compress) {
+    int             compress,
+    int             slot) {
   string    temp_path;
   string    dest_path;
   string    checksum;
@@ -141,27 +392,47 @@ int Database::write(
   }
 
   /* Temporary file to write to */
-  temp_path = _path + "/filedata";
-  Stream temp(temp_path.c_str());
-  if (temp.open("w", compress)) {
-    cerr << strerror(errno) << ": " << temp_path << endl;
-    failed = -1;
-  } else
+  if ((compress == 0) && (source.size() >= resume_size)) {
+    // Copied data of source survives interruptions
+    temp_path = _path + "/" + partialName(path);
+    if (copyResumable(source, path, temp_path)) {
+      if (errno != EINTR) {
+        cerr << strerror(errno) << ": " << path << endl;
+        std::remove(temp_path.c_str());
+      }
+      failed = -1;
+    }
+  } else {
+    temp_path = _path + "/filedata";
+    if (slot > 0) {
+      stringstream ss;
+      ss << "." << slot;
+      temp_path += ss.str();
+    }
+    Stream temp(temp_path.c_str());
+    if (temp.open("w", compress)) {
+      cerr << strerror(errno) << ": " << temp_path << endl;
+      failed = -1;
+    } else
 
-  /* Copy file locally */
-  if (temp.copy(source)) {
-    cerr << strerror(errno) << ": " << path << endl;
-    failed = -1;
+    /* Copy file locally */
+    if (temp.copy(source)) {
+      cerr << strerror(errno) << ": " << path << endl;
+      failed = -1;
+    }
+    temp.close();
   }
 
+  // Leave the cache to data in use
+  source.uncache();
   source.close();
-  temp.close();
 
   if (failed) {
     return failed;
   }
 
-  /* Get file final location */
+  /* Get file final location, one write at a time */
+  pthread_mutex_lock(&_d->data_lock);
   if (getDir(source.checksum(), dest_path, true) == 2) {
     cerr << "db: write: failed to get dir for: " << source.checksum() << endl;
     failed = -1;
@@ -227,6 +498,7 @@ int Database::write(
       organise(dest_path, 256);
     }
   }
+  pthread_mutex_unlock(&_d->data_lock);
 
   return failed;
 }
@@ -310,40 +582,446 @@ int Database::getDir(
   return ! Directory(path.c_str()).isValid();
 }
 
-int Database::merge() {
-  bool failed = false;
+int Database::merge(Partition& partition) {
+  string journal_name;
+
+  // Merge segments together first, so the active list only gets written once
+  if (mergeSegments(partition.path, partition.segments, segment,
+      "journal.all", journal_name)
+   || makeActive(partition.path, "active", journal_name.c_str())) {
+    return -1;
+  }
+
+  // Segments are now in the active list, keep them as history
+  if (rename((partition.path + "/" + journal_name).c_str(),
+      (partition.path + "/" + history(partition.history + 1)).c_str())) {
+    cerr << "db: close: cannot rename segments" << endl;
+    return -1;
+  }
+  partition.history++;
+  std::remove((partition.path + "/journal.all").c_str());
+  while (partition.segments > 0) {
+    std::remove((partition.path + "/" + segment(partition.segments)).c_str());
+    partition.segments--;
+  }
+
+  if (partition.history > max_history) {
+    return fold(partition);
+  }
+  return 0;
+}
+
+int Database::fold(Partition& partition) {
+  const char* path   = partition.path.c_str();
+  bool        failed = false;
+  string      history_name;
+
+  // Merge history together first, so the list only gets written once
+  if (mergeSegments(partition.path, partition.history, history,
+      "history.all", history_name)) {
+    return -1;
+  }
 
   // Merge with existing list into new one
-  List list(_path.c_str(), "list.part");
-  if (! list.open("w")) {
-    if (list.merge(*_d->list, *_d->journal) && (errno != EBUSY)) {
-      cerr << "db: close: merge failed" << endl;
+  List journal(path, history_name.c_str());
+  List list(path, "list");
+  List merged(path, "list.part");
+  if (journal.open("r") || list.open("r")
+   || merged.open("w", list_compression)) {
+    cerr << strerror(errno) << ": failed to open lists" << endl;
+    failed = true;
+  } else
+  if (merged.merge(list, journal)) {
+    cerr << "db: close: merge failed" << endl;
+    failed = true;
+  }
+  journal.close();
+  list.close();
+  merged.close();
+  if (! failed) {
+    if (rename((partition.path + "/list").c_str(),
+          (partition.path + "/list~").c_str())
+    || rename((partition.path + "/list.part").c_str(),
+          (partition.path + "/list").c_str())) {
+      cerr << "db: close: cannot rename lists" << endl;
       failed = true;
     }
-    list.close();
-    if (! failed) {
-      if (rename((_path + "/list").c_str(), (_path + "/list~").c_str())
-      || rename((_path + "/list.part").c_str(), (_path + "/list").c_str())) {
-        cerr << "db: close: cannot rename lists" << endl;
+  }
+  if (failed) {
+    return -1;
+  }
+
+  // History is now in the list
+  std::remove((partition.path + "/history.all").c_str());
+  while (partition.history > 0) {
+    std::remove((partition.path + "/" + history(partition.history)).c_str());
+    partition.history--;
+  }
+  return 0;
+}
+
+void* Database::mergeThread(void* data) {
+  Partition* partition = (Partition*) data;
+  partition->rc = merge(*partition);
+  return NULL;
+}
+
+int Database::recover(Partition& partition, List& journal) {
+  string  name = segment(partition.segments + 1);
+  List    segment_list(partition.path.c_str(), name.c_str());
+  time_t  timestamp;
+  char*   prefix = NULL;
+  char*   path   = NULL;
+  Node*   node   = NULL;
+  int     rc     = 0;
+  int     status;
+  int     records = 0;
+
+  if (segment_list.open("w", list_compression, journal_block_size)) {
+    cerr << strerror(errno) << ": failed to open segment" << endl;
+    return -1;
+  }
+  // Copy records up to the first damaged one: a crash loses what was written
+  // since the last checkpoint, which may have been cut anywhere
+  while ((status = journal.getEntry(&timestamp, &prefix, &path, &node)) > 0) {
+    if (node != NULL) {
+      rc = segment_list.added(prefix, path, node, timestamp);
+    } else {
+      rc = segment_list.removed(prefix, path, timestamp);
+    }
+    if (rc) {
+      break;
+    }
+    records++;
+  }
+  if (rc == 0) {
+    cout << "Recovered " << records << " record(s)";
+    if (status < 0) {
+      cout << ", dropping damaged end of journal";
+    }
+    cout << endl;
+  }
+  free(prefix);
+  free(path);
+  free(node);
+  if (segment_list.close() || rc) {
+    cerr << "db: open: cannot write segment" << endl;
+    std::remove((partition.path + "/" + name).c_str());
+    return -1;
+  }
+  partition.segments++;
+  return 0;
+}
+
+int Database::loadPartitions() {
+  Stream  index((_path + "/lists").c_str(), "index");
+  String  line;
+  ssize_t length;
+  int     rc = 0;
+
+  _d->partitions.clear();
+  _d->last      = NULL;
+  _d->loaded    = NULL;
+  _d->versioned = NULL;
+  _d->versions.clear();
+  // No partitions yet
+  if (! index.isValid()) {
+    return 0;
+  }
+  if (index.open("r")) {
+    cerr << strerror(errno) << ": cannot open partitions index" << endl;
+    return -1;
+  }
+  // Line format: directory name, tab, prefix
+  while ((length = index.getLine(line)) > 0) {
+    const char* tab = strchr(line.c_str(), '\t');
+    if ((tab == NULL) || (line[length - 1] != '\n')) {
+      errno = EUCLEAN;
+      rc    = -1;
+      break;
+    }
+    Partition partition;
+    partition.name     = string(line.c_str(), tab - line.c_str());
+    partition.path     = _path + "/lists/" + partition.name;
+    partition.prefix   = StrPath(&tab[1], length - (tab - line.c_str()) - 2);
+    partition.segments = 0;
+    partition.history  = 0;
+    partition.journal  = NULL;
+    partition.rc       = 0;
+    partition.opened   = false;
+    list<Partition>::iterator i = _d->partitions.begin();
+    while ((i != _d->partitions.end()) && (i->prefix < partition.prefix)) {
+      i++;
+    }
+    _d->partitions.insert(i, partition);
+  }
+  if (length < 0) {
+    rc = -1;
+  }
+  index.close();
+  if (rc) {
+    cerr << "db: partitions index corrupted" << endl;
+  }
+  return rc;
+}
+
+int Database::savePartitions() {
+  Stream  index((_path + "/lists").c_str(), "index.part");
+  bool    failed = false;
+
+  if (index.open("w")) {
+    failed = true;
+  } else {
+    for (list<Partition>::iterator i = _d->partitions.begin();
+        i != _d->partitions.end(); i++) {
+      string line = i->name + "\t" + i->prefix.c_str() + "\n";
+      if (index.write(line.c_str(), line.length()) < 0) {
         failed = true;
       }
     }
-  } else {
-    cerr << strerror(errno) << ": failed to open temporary list" << endl;
+    if (index.close()) {
+      failed = true;
+    }
+  }
+  if (! failed && rename((_path + "/lists/index.part").c_str(),
+      (_path + "/lists/index").c_str())) {
+    failed = true;
+  }
+  if (failed) {
+    cerr << strerror(errno) << ": cannot write partitions index" << endl;
+    return -1;
+  }
+  return 0;
+}
+
+Database::Partition* Database::partition(
+    const char*   prefix,
+    bool          create) {
+  // Records come grouped by prefix
+  if ((_d->last != NULL) && (_d->last->prefix == prefix)) {
+    return _d->last;
+  }
+  int cmp = 1;
+  list<Partition>::iterator i = _d->partitions.begin();
+  while ((i != _d->partitions.end()) && ((cmp = i->prefix.compare(prefix)) < 0)) {
+    i++;
+  }
+  if (cmp == 0) {
+    _d->last = &*i;
+    return _d->last;
+  }
+  if (! create) {
+    return NULL;
+  }
+
+  // Partitions are named after their creation order, and never removed
+  stringstream ss;
+  ss << _d->partitions.size();
+  Partition partition;
+  partition.name     = ss.str();
+  partition.path     = _path + "/lists/" + partition.name;
+  partition.prefix   = prefix;
+  partition.segments = 0;
+  partition.history  = 0;
+  partition.journal  = NULL;
+  partition.rc       = 0;
+  partition.opened   = true;
+  i = _d->partitions.insert(i, partition);
+
+  // Index first, so we never leave an unknown partition behind
+  List list(i->path.c_str(), "list");
+  List active(i->path.c_str(), "active");
+  if (savePartitions()
+   || (mkdir(i->path.c_str(), 0755) && (errno != EEXIST))
+   || list.open("w", list_compression) || list.close()
+   || active.open("w", list_compression) || active.close()) {
+    cerr << "db: cannot create partition for " << prefix << endl;
+    _d->partitions.erase(i);
+    savePartitions();
+    return NULL;
+  }
+  _d->last = &*i;
+  return _d->last;
+}
+
+int Database::openPartition(Partition& partition) {
+  const char* path = partition.path.c_str();
+
+  if (! File(path, "list").isValid()) {
+    cerr << "db: list not accessible...";
+    if (File(path, "list~").isValid()) {
+      cerr << "using backup" << endl;
+      rename((partition.path + "/list~").c_str(),
+        (partition.path + "/list").c_str());
+    } else {
+      cerr << "no backup accessible, aborting.";
+      return -1;
+    }
+  }
+
+  // Count segments left by previous runs
+  partition.segments = 0;
+  while (File(path, segment(partition.segments + 1).c_str()).isValid()) {
+    partition.segments++;
+  }
+  partition.history = 0;
+  while (File(path, history(partition.history + 1).c_str()).isValid()) {
+    partition.history++;
+  }
+
+  // Active list missing (older version): make it from list and history
+  if (! File(path, "active").isValid()
+   && (((partition.history > 0) && fold(partition))
+    || makeActive(partition.path, "list"))) {
+    return -1;
+  }
+
+  // Check previous crash
+  List journal(path, "journal");
+  if (! journal.open("r")) {
+    cout << "Previous crash detected, attempting recovery" << endl;
+    int rc = recover(partition, journal);
+    journal.close();
+    if (rc) {
+      cerr << "db: open: cannot recover from previous crash" << endl;
+      return -1;
+    }
+    rename((partition.path + "/journal").c_str(),
+      (partition.path + "/journal~").c_str());
+  }
+  partition.opened = true;
+  return 0;
+}
+
+int Database::load(Partition& partition) {
+  if (_d->loaded == &partition) {
+    return 0;
+  }
+  _d->active.clear();
+  _d->loaded = NULL;
+  if (! partition.opened && openPartition(partition)) {
+    return -1;
+  }
+  bool failed = false;
+  if (_d->active.open(partition.path, "active")) {
     failed = true;
   }
+  for (int j = 1; (j <= partition.segments) && ! failed; j++) {
+    if (_d->active.apply(partition.path, segment(j))) {
+      failed = true;
+    }
+  }
   if (failed) {
+    cerr << "db: cannot load list for " << partition.prefix.c_str() << endl;
+    _d->active.clear();
+    return -1;
+  }
+  _d->loaded = &partition;
+  if (verbosity() > 2) {
+    cout << " --> Loaded list for " << partition.prefix.c_str() << " (contents: "
+      << _d->active.size() << " file";
+    if (_d->active.size() != 1) {
+      cout << "s";
+    }
+    cout << ")" << endl;
+  }
+  if (verbosity() > 3) {
+    cout << " --> Active list memory: " << _d->active.memory() << " bytes"
+      << endl;
+  }
+  return 0;
+}
+
+int Database::split() {
+  // The single list and its segments make a partition of their own
+  Partition legacy;
+  legacy.path     = _path;
+  legacy.segments = 0;
+  legacy.history  = 0;
+  legacy.journal  = NULL;
+  legacy.opened   = false;
+  if (openPartition(legacy)
+   || ((legacy.segments > 0) && merge(legacy))
+   || ((legacy.history > 0) && fold(legacy))) {
     return -1;
   }
+
+  List list(_path.c_str(), "list");
+  if (list.open("r")) {
+    cerr << strerror(errno) << ": cannot open list" << endl;
+    return -1;
+  }
+  String  prefix;
+  int     rc;
+  while ((rc = list.nextPrefix(prefix)) > 0) {
+    Partition* partition = this->partition(prefix.c_str(), true);
+    if (partition == NULL) {
+      rc = -1;
+      break;
+    }
+    List partition_list(partition->path.c_str(), "list");
+    if (partition_list.open("w", list_compression)
+     || partition_list.copyPrefix(list)) {
+      rc = -1;
+    }
+    if (partition_list.close()
+     || ((rc >= 0) && makeActive(partition->path, "list"))) {
+      rc = -1;
+    }
+    if (rc < 0) {
+      break;
+    }
+  }
+  list.close();
+  if (rc < 0) {
+    cerr << "db: open: cannot split list into partitions" << endl;
+    return -1;
+  }
+  // Keep old list as backup
+  rename((_path + "/list").c_str(), (_path + "/list~").c_str());
+  std::remove((_path + "/active").c_str());
+  if (verbosity() > 2) {
+    cout << " --> List split into " << _d->partitions.size() << " partition";
+    if (_d->partitions.size() != 1) {
+      cout << "s";
+    }
+    cout << endl;
+  }
   return 0;
 }
 
+List* Database::getJournal(const char* prefix) {
+  Partition* partition = this->partition(prefix, true);
+  if (partition == NULL) {
+    return NULL;
+  }
+  // Recover journal left by a crash before starting a new one
+  if (! partition->opened && openPartition(*partition)) {
+    return NULL;
+  }
+  if (partition->journal == NULL) {
+    partition->journal = new List(partition->path.c_str(), "journal");
+    if (partition->journal->open("w", list_compression, journal_block_size)) {
+      cerr << strerror(errno) << ": cannot open journal for " << prefix
+        << endl;
+      delete partition->journal;
+      partition->journal = NULL;
+    }
+  }
+  return partition->journal;
+}
+
 Database::Database(const string& path) {
   _path          = path;
   _d             = new Private;
+  _d->last       = NULL;
+  _d->loaded     = NULL;
+  _d->versioned  = NULL;
+  pthread_mutex_init(&_d->data_lock, NULL);
 }
 
 Database::~Database() {
+  pthread_mutex_destroy(&_d->data_lock);
   delete _d;
 }
 
@@ -360,145 +1038,311 @@ int Database::open() {
     return 2;
   }
 
-  List list(_path.c_str(), "list");
-
   // Check DB dir
   if (! Directory((_path + "/data").c_str()).isValid()) {
     if (Directory(_path.c_str(), "data").create(_path.c_str())) {
       cerr << "db: cannot create data directory" << endl;
       failed = true;
     } else
-    if (list.open("w") || list.close()) {
-      cerr << "db: cannot create list file" << endl;
-      failed = true;
-    } else
     if (verbosity() > 2) {
       cout << " --> Database initialized" << endl;
     }
-  } else {
-    if (! list.isValid()) {
-      Stream backup(_path.c_str(), "list~");
+  }
+  if (! failed && ! Directory((_path + "/lists").c_str()).isValid()
+   && mkdir((_path + "/lists").c_str(), 0755)) {
+    cerr << "db: cannot create lists directory" << endl;
+    failed = true;
+  }
 
-      cerr << "db: list not accessible...";
-      if (backup.isValid()) {
-        cerr << "using backup" << endl;
-        rename((_path + "/list~").c_str(), (_path + "/list").c_str());
-      } else {
-        cerr << "no backup accessible, aborting.";
-        failed = true;
-      }
+  // Read index of partitions, split single list from older versions
+  if (! failed
+   && (loadPartitions()
+    || (File(_path.c_str(), "list").isValid() && split()))) {
+    failed = true;
+  }
+
+  // Lists are only loaded when first needed
+  _d->active.clear();
+  _d->loaded = NULL;
+
+  if (failed) {
+    // Unlock DB
+    unlock();
+    return 2;
+  }
+  if (verbosity() > 2) {
+    cout << " --> Database open (clients: "
+      << _d->partitions.size() << ")" << endl;
+  }
+  return 0;
+}
+
+int Database::checkpoint() {
+  int rc = 0;
+  for (list<Partition>::iterator i = _d->partitions.begin();
+      i != _d->partitions.end(); i++) {
+    if ((i->journal != NULL) && i->journal->checkpoint()) {
+      rc = -1;
     }
   }
+  return rc;
+}
 
-  // Open list
-  if (! failed) {
-    _d->list = new List(_path.c_str(), "list");
-    if (_d->list->open("r")) {
-      cerr << "db: open: cannot open list" << endl;
-      failed = true;
+// Walk progress of client paths, one per line: path, tab, directory
+static int readProgress(
+    const string&         dir_path,
+    map<string, string>&  progress) {
+  Stream  file(dir_path.c_str(), "progress");
+  String  line;
+  ssize_t length;
+
+  if (! file.isValid()) {
+    return 0;
+  }
+  if (file.open("r")) {
+    return -1;
+  }
+  while ((length = file.getLine(line)) > 0) {
+    const char* tab = strchr(line.c_str(), '\t');
+    if ((tab == NULL) || (line[length - 1] != '\n')) {
+      // Cut by a crash: walk again
+      break;
     }
+    progress[string(line.c_str(), tab - line.c_str())] =
+      string(&tab[1], length - (tab - line.c_str()) - 2);
   }
+  file.close();
+  return (length < 0) ? -1 : 0;
+}
 
-  // Deal with journal
-  if (! failed) {
-    _d->journal = new List(_path.c_str(), "journal");
+static int writeProgress(
+    const string&         dir_path,
+    const map<string, string>& progress) {
+  Stream  file(dir_path.c_str(), "progress.part");
+  bool    failed = false;
 
-    // Check previous crash
-    if (! _d->journal->open("r")) {
-      cout << "Previous crash detected, attempting recovery" << endl;
-      if (merge()) {
-        cerr << "db: open: cannot recover from previous crash" << endl;
+  if (file.open("w")) {
+    failed = true;
+  } else {
+    for (map<string, string>::const_iterator i = progress.begin();
+        i != progress.end(); i++) {
+      string line = i->first + "\t" + i->second + "\n";
+      if (file.write(line.c_str(), line.length()) < 0) {
         failed = true;
       }
-      _d->journal->close();
-      _d->list->close();
-
-      if (! failed) {
-        rename((_path + "/journal").c_str(), (_path + "/journal~").c_str());
-        // Re-open list
-        if (_d->list->open("r")) {
-          cerr << "db: open: cannot re-open list" << endl;
-          failed = true;
-        }
-      }
     }
-
-    // Create journal
-    if (! failed && (_d->journal->open("w"))) {
-      cerr << "db: open: cannot open journal" << endl;
+    if (file.close()) {
       failed = true;
     }
   }
+  if (! failed && rename((dir_path + "/progress.part").c_str(),
+      (dir_path + "/progress").c_str())) {
+    failed = true;
+  }
+  return failed ? -1 : 0;
+}
 
-  // Read database active items list
-  if (! failed) {
-    _d->active.clear();
-    if (_d->active.open(_path, "list")) {
-      failed = true;
-    }
+int Database::setProgress(
+    const char*     prefix,
+    const char*     base_path,
+    const char*     rel_path) {
+  Partition* part = partition(prefix, true);
+  if (part == NULL) {
+    return -1;
+  }
+  map<string, string> progress;
+  readProgress(part->path, progress);
+  progress[base_path] = rel_path;
+  if (writeProgress(part->path, progress)) {
+    cerr << strerror(errno) << ": cannot save progress for " << prefix
+      << endl;
+    return -1;
   }
-  _d->entry = _d->active.begin();
+  return 0;
+}
 
-  if (failed) {
-      // Close lists
-    _d->list->close();
-    _d->journal->close();
+int Database::getProgress(
+    const char*     prefix,
+    const char*     base_path,
+    string&         rel_path) {
+  Partition* part = partition(prefix);
+  if (part == NULL) {
+    return 0;
+  }
+  map<string, string> progress;
+  if (readProgress(part->path, progress)) {
+    return 0;
+  }
+  map<string, string>::iterator i = progress.find(base_path);
+  if (i == progress.end()) {
+    return 0;
+  }
+  rel_path = i->second;
+  return 1;
+}
 
-    // Delete lists
-    delete _d->journal;
-    delete _d->list;
+void Database::clearProgress(
+    const char*     prefix) {
+  Partition* part = partition(prefix);
+  if (part != NULL) {
+    std::remove((part->path + "/progress").c_str());
+  }
+}
 
-    // Unlock DB
-    unlock();
-    return 2;
+// Line format: end of last complete backup, tab, its duration, tab, time
+// spent since
+int Database::getSchedule(
+    const char*     prefix,
+    time_t&         done,
+    int&            cost,
+    int&            spent) {
+  done  = 0;
+  cost  = 0;
+  spent = 0;
+  Partition* part = partition(prefix);
+  if (part == NULL) {
+    return 0;
   }
-  if (verbosity() > 2) {
-    cout << " --> Database open (contents: "
-      << _d->active.size() << " file";
-    if (_d->active.size() != 1) {
-      cout << "s";
-    }
-    cout << ")" << endl;
+  Stream file(part->path.c_str(), "schedule");
+  if (! file.isValid()) {
+    return 0;
   }
+  if (file.open("r")) {
+    return -1;
+  }
+  String line;
+  if ((file.getLine(line) > 0)
+   && (sscanf(line.c_str(), "%ld\t%d\t%d", &done, &cost, &spent) != 3)) {
+    done  = 0;
+    cost  = 0;
+    spent = 0;
+  }
+  file.close();
   return 0;
 }
 
-int Database::close() {
-  bool failed = false;
-
-  // Close lists
-  _d->journal->close();
-  _d->list->close();
-
-  // Re-open lists
-  if (_d->journal->open("r")) {
-    cerr << "db: close: cannot re-open journal" << endl;
-    failed = true;
+int Database::setSchedule(
+    const char*     prefix,
+    time_t          done,
+    int             cost,
+    int             spent) {
+  Partition* part = partition(prefix, true);
+  if (part == NULL) {
+    return -1;
   }
-  if (_d->list->open("r")) {
-    cerr << "db: close: cannot re-open list" << endl;
+  stringstream ss;
+  ss << done << "\t" << cost << "\t" << spent << "\n";
+  Stream file(part->path.c_str(), "schedule.part");
+  bool   failed = false;
+  if (file.open("w")) {
     failed = true;
+  } else {
+    if (file.write(ss.str().c_str(), ss.str().length()) < 0) {
+      failed = true;
+    }
+    if (file.close()) {
+      failed = true;
+    }
   }
-
-  // Merge journal into list
-  if (merge()) {
+  if (! failed && rename((part->path + "/schedule.part").c_str(),
+      (part->path + "/schedule").c_str())) {
     failed = true;
   }
+  if (failed) {
+    cerr << strerror(errno) << ": cannot save schedule for " << prefix
+      << endl;
+    return -1;
+  }
+  return 0;
+}
 
-  // Close lists
-  _d->journal->close();
-  _d->list->close();
+int Database::close() {
+  bool              failed = false;
+  list<Partition*>  merges;
+
+  for (list<Partition>::iterator i = _d->partitions.begin();
+      i != _d->partitions.end(); i++) {
+    // Only partitions written to this time
+    if (i->journal == NULL) {
+      continue;
+    }
+    i->journal->close();
+    delete i->journal;
+    i->journal = NULL;
+
+    // Keep journal as new segment, also as backup
+    string name = segment(i->segments + 1);
+    if (rename((i->path + "/journal").c_str(),
+        (i->path + "/" + name).c_str())) {
+      cerr << "db: close: cannot rename journal" << endl;
+      failed = true;
+      continue;
+    }
+    i->segments++;
+    std::remove((i->path + "/journal~").c_str());
+    link((i->path + "/" + name).c_str(), (i->path + "/journal~").c_str());
+
+    // Fold segments into list when needed
+    long long size = 0;
+    for (int j = 1; j <= i->segments; j++) {
+      size += File(i->path.c_str(), segment(j).c_str()).size();
+    }
+    if ((i->segments > max_segments)
+     || (size * segments_ratio > File(i->path.c_str(), "active").size())) {
+      merges.push_back(&*i);
+    }
+  }
 
-  // Delete lists
-  delete _d->journal;
-  delete _d->list;
+  // Partitions are independent, merge a few at a time
+  list<Partition*>::iterator i = merges.begin();
+  while (i != merges.end()) {
+    pthread_t threads[max_merges];
+    int       count = 0;
+    while ((i != merges.end()) && (count < max_merges)) {
+      if (pthread_create(&threads[count], NULL, mergeThread, *i)) {
+        // No thread, do it here
+        mergeThread(*i);
+      } else {
+        count++;
+      }
+      i++;
+    }
+    while (count > 0) {
+      pthread_join(threads[--count], NULL);
+    }
+  }
+  for (i = merges.begin(); i != merges.end(); i++) {
+    if ((*i)->rc) {
+      failed = true;
+    }
+  }
+  _d->last      = NULL;
+  _d->loaded    = NULL;
+  _d->versioned = NULL;
+  _d->active.clear();
+  _d->versions.clear();
+
+  // Partial copies not resumed for long are of files that went away
+  DIR* directory;
+  if (! terminating() && ((directory = opendir(_path.c_str())) != NULL)) {
+    time_t         expired = time(NULL) - partial_expiry;
+    struct dirent* dir_entry;
+    while ((dir_entry = readdir(directory)) != NULL) {
+      if (strncmp(dir_entry->d_name, "partial.", 8) != 0) {
+        continue;
+      }
+      File partial(_path.c_str(), dir_entry->d_name);
+      if (partial.isValid() && (partial.mtime() < expired)) {
+        std::remove((_path + "/" + dir_entry->d_name).c_str());
+      }
+    }
+    closedir(directory);
+  }
 
   // Release lock
   unlock();
   if (failed) {
     return -1;
-  } else {
-    rename((_path + "/journal").c_str(), (_path + "/journal~").c_str());
   }
   if (verbosity() > 2) {
     cout << " --> Database closed" << endl;
@@ -506,59 +1350,126 @@ int Database::close() {
   return 0;
 }
 
-void Database::getList(
+int Database::getList(
     const char*  prefix,
     const char*  base_path,
     const char*  rel_path,
-    list<Node*>& list) {
-  char* full_path = NULL;
-  int length = asprintf(&full_path, "%s/%s/%s/", prefix, base_path, rel_path);
+    vector<const DbData*>& list) {
+  // Load client's list if not done yet (unknown clients have no records)
+  Partition* partition = this->partition(prefix);
+  if (partition == NULL) {
+    _d->active.clear();
+    _d->loaded = NULL;
+    return 0;
+  }
+  if (load(*partition)) {
+    return -1;
+  }
+
+  // All records have the same prefix, only compare paths
+  char* dir_path = NULL;
+  int length = asprintf(&dir_path, "%s/%s/", base_path, rel_path);
   if (rel_path[0] == '\0') {
-    full_path[--length] = '\0';
-  }
-
-  // Look for beginning
-  if ((_d->entry == _d->active.end()) && (_d->entry != _d->active.begin())) {
-    _d->entry--;
-  }
-  // Jump irrelevant last records
-  while ((_d->entry != _d->active.begin())
-      && (_d->entry->pathCompare(full_path, length) >= 0)) {
-    _d->entry--;
-  }
-  // Jump irrelevant first records
-  while ((_d->entry != _d->active.end())
-      && (_d->entry->pathCompare(full_path) < 0)) {
-    _d->entry++;
-  }
-  // Copy relevant records
-  char* last_dir     = NULL;
-  int   last_dir_len = 0;
-  while ((_d->entry != _d->active.end())
-      && (_d->entry->pathCompare(full_path, length) == 0)) {
-    if ((last_dir == NULL) || _d->entry->pathCompare(last_dir, last_dir_len)) {
-      Node* node;
-      switch (_d->entry->data()->type()) {
-        case 'f':
-          node = new File(*((File*) _d->entry->data()));
-          break;
-        case 'l':
-          node = new Link(*((Link*) _d->entry->data()));
-          break;
-        default:
-          node = new Node(*_d->entry->data());
-      }
-      if (node->type() == 'd') {
-        free(last_dir);
-        last_dir = NULL;
-        last_dir_len = asprintf(&last_dir, "%s%s/", full_path, node->name());
-      }
-      list.push_back(node);
+    dir_path[--length] = '\0';
+  }
+
+  // Copy pointers to records in directory, skipping sub-directories contents
+  DbList::iterator entry = _d->active.find(dir_path);
+  while ((entry != _d->active.end())
+      && (Node::pathCompare(entry->path(), dir_path, length) == 0)) {
+    list.push_back(&*entry);
+    if (entry->type() == 'd') {
+      entry = _d->active.find(entry->path(), true);
+    } else {
+      entry++;
     }
-    _d->entry++;
   }
-  free(last_dir);
-  free(full_path);
+  free(dir_path);
+  return 0;
+}
+
+int Database::getCursor(
+    const char*  prefix,
+    const char*  base_path,
+    const char*  rel_path,
+    Cursor&      cursor) {
+  free(cursor._dir_path);
+  cursor._dir_path = NULL;
+  cursor._next     = static_cast<size_t>(-1);
+  Partition* partition = this->partition(prefix);
+  if (partition == NULL) {
+    _d->active.clear();
+    _d->loaded = NULL;
+    return 0;
+  }
+  if (load(*partition)) {
+    return -1;
+  }
+  cursor._length = asprintf(&cursor._dir_path, "%s/%s/", base_path, rel_path);
+  if (rel_path[0] == '\0') {
+    cursor._dir_path[--cursor._length] = '\0';
+  }
+  cursor._next = _d->active.find(cursor._dir_path) - _d->active.begin();
+  return 0;
+}
+
+const DbData* Database::next(
+    Cursor&      cursor) {
+  if (cursor._next == static_cast<size_t>(-1)) {
+    return NULL;
+  }
+  DbList::iterator entry = _d->active.begin() + cursor._next;
+  if ((entry == _d->active.end())
+   || (Node::pathCompare(entry->path(), cursor._dir_path, cursor._length)
+    != 0)) {
+    cursor._next = static_cast<size_t>(-1);
+    return NULL;
+  }
+  // Skip sub-directories contents
+  if (entry->type() == 'd') {
+    cursor._next = _d->active.find(entry->path(), true) - _d->active.begin();
+  } else {
+    cursor._next++;
+  }
+  return &*entry;
+}
+
+int Database::getSnapshot(
+    const char*  prefix,
+    time_t       date,
+    vector<const DbData*>& list) {
+  Partition* partition = this->partition(prefix);
+  if (partition == NULL) {
+    return 0;
+  }
+  // Read all versions of client's records once, for any date
+  if (_d->versioned != partition) {
+    _d->versions.clear();
+    _d->versioned = NULL;
+    if (! partition->opened && openPartition(*partition)) {
+      return -1;
+    }
+    bool failed = _d->versions.add(partition->path, "list") != 0;
+    for (int j = 1; (j <= partition->history) && ! failed; j++) {
+      failed = _d->versions.add(partition->path, history(j)) != 0;
+    }
+    for (int j = 1; (j <= partition->segments) && ! failed; j++) {
+      failed = _d->versions.add(partition->path, segment(j)) != 0;
+    }
+    if (failed) {
+      cerr << "db: cannot read versions for " << prefix << endl;
+      _d->versions.clear();
+      return -1;
+    }
+    _d->versioned = partition;
+    if (verbosity() > 2) {
+      cout << " --> Loaded versions for " << prefix << " (records: "
+        << _d->versions.size() << ", paths: " << _d->versions.paths() << ")"
+        << endl;
+    }
+  }
+  _d->versions.snapshot(prefix, date, list);
+  return 0;
 }
 
 int Database::read(const string& path, const string& checksum) {
@@ -628,19 +1539,46 @@ int Database::scan(const String& checksum, bool thorough) {
     char*       path   = NULL;
     Node*       node   = NULL;
 
-    // Get list of checksums
-    while (_d->list->getEntry(NULL, NULL, &path, &node) > 0) {
-      if (node->type() == 'f') {
-        File *f = (File*) node;
-        if (f->checksum()[0] != '\0') {
-          sums.push_back(f->checksum());
-        }
+    // Get list of checksums, from lists, history and segments of all
+    // partitions
+    for (list<Partition>::iterator p = _d->partitions.begin();
+        p != _d->partitions.end(); p++) {
+      if (! p->opened && openPartition(*p)) {
+        failed = 1;
+        continue;
       }
-      if (terminating()) {
-        errno = EINTR;
-        return -1;
+      list<string> names;
+      names.push_back("list");
+      for (int i = 1; i <= p->history; i++) {
+        names.push_back(history(i));
+      }
+      for (int i = 1; i <= p->segments; i++) {
+        names.push_back(segment(i));
+      }
+      for (list<string>::iterator i = names.begin(); i != names.end(); i++) {
+        List list(p->path.c_str(), i->c_str());
+        if (list.open("r")) {
+          cerr << strerror(errno) << ": cannot open list in " << p->path
+            << endl;
+          continue;
+        }
+        while (list.getEntry(NULL, NULL, &path, &node) > 0) {
+          if ((node != NULL) && (node->type() == 'f')) {
+            File *f = (File*) node;
+            if (f->checksum()[0] != '\0') {
+              sums.push_back(f->checksum());
+            }
+          }
+          if (terminating()) {
+            errno = EINTR;
+            return -1;
+          }
+        }
+        list.close();
       }
     }
+    free(path);
+    free(node);
     sums.sort();
     sums.unique();
     if (verbosity() > 2) {
@@ -710,13 +1648,26 @@ int Database::scan(const String& checksum, bool thorough) {
   return failed;
 }
 
+int Database::copy(
+    const char* dir_path,
+    const char* name,
+    char**      checksum,
+    int         slot) {
+  char* local_path = NULL;
+  asprintf(&local_path, "%s/%s", dir_path, name);
+  int rc = write(string(local_path), checksum, 0, slot);
+  free(local_path);
+  return rc;
+}
+
 int Database::add(
     const char* prefix,
     const char* base_path,
     const char* rel_path,
     const char* dir_path,
     const Node* node,
-    const char* old_checksum) {
+    const char* old_checksum,
+    const char* hard_link) {
   bool failed = false;
 
   // Add new record to active list
@@ -741,6 +1692,7 @@ int Database::add(
       break;
     case 'f':
       node2 = new File(*node);
+      ((File*)node2)->setHardLink(hard_link);
       if ((old_checksum != NULL) && (old_checksum[0] != '\0')) {
         // Use same checksum
         ((File*)node2)->setChecksum(old_checksum);
@@ -764,8 +1716,11 @@ int Database::add(
 
   if (! failed || (old_checksum == NULL)) {
     // Add entry info to journal
-    _d->journal->added(prefix, full_path, node2,
-      (old_checksum != NULL) && (old_checksum[0] == '\0') ? 0 : -1);
+    List* journal = getJournal(prefix);
+    if ((journal == NULL) || journal->added(prefix, full_path, node2,
+        (old_checksum != NULL) && (old_checksum[0] == '\0') ? 0 : -1)) {
+      failed = true;
+    }
   }
 
   free(full_path);
@@ -779,16 +1734,19 @@ void Database::remove(
     const char* prefix,
     const char* base_path,
     const char* rel_path,
-    const Node* node) {
+    const char* name) {
   char* full_path = NULL;
   if (rel_path[0] != '\0') {
-    asprintf(&full_path, "%s/%s/%s", base_path, rel_path, node->name());
+    asprintf(&full_path, "%s/%s/%s", base_path, rel_path, name);
   } else {
-    asprintf(&full_path, "%s/%s", base_path, node->name());
+    asprintf(&full_path, "%s/%s", base_path, name);
   }
 
   // Add entry info to journal
-  _d->journal->removed(prefix, full_path);
+  List* journal = getJournal(prefix);
+  if (journal != NULL) {
+    journal->removed(prefix, full_path);
+  }
 
   free(full_path);
 }
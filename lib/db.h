@@ -21,14 +21,47 @@
 
 namespace hbackup {
 
+class List;
+class DbData;
+
 class Database {
   struct        Private;
+  struct        Partition;
   Private*      _d;
   string        _path;
   list<string>  _active_checksums;
   int  lock();
   void unlock();
-  int  merge();
+  // Fold journal segments into active list, keeping them as history
+  static int merge(
+    Partition&      partition);
+  // Fold history into list
+  static int fold(
+    Partition&      partition);
+  static void* mergeThread(
+    void*           data);
+  // Make journal left by a crash into a segment
+  static int recover(
+    Partition&      partition,
+    List&           journal);
+  // Read/write index of partitions
+  int  loadPartitions();
+  int  savePartitions();
+  // Find partition for prefix, create it if required
+  Partition* partition(
+    const char*     prefix,
+    bool            create = false);
+  // Check partition lists, count segments, recover journal
+  int  openPartition(
+    Partition&      partition);
+  // Move contents of single list from older versions into partitions
+  int  split();
+  // Load active records of partition, replacing those of any other
+  int  load(
+    Partition&      partition);
+  // Get journal for prefix, opening it if needed
+  List* getJournal(
+    const char*     prefix);
 protected: // So I can test them/use them in tests
   int getDir(
     const string&   checksum,
@@ -37,24 +70,82 @@ protected: // So I can test them/use them in tests
   int  organise(
     const string&   path,
     int             number);
+  // Several writes may run at once, each with its own temporary file slot
   int  write(
     const string&   path,
     char**          checksum,
-    int             compress = 0);
+    int             compress = 0,
+    int             slot = 0);
 public:
   Database(const string& path);
   ~Database();
   string path() const { return _path; }
-  /* Open database */
+  /* Open database (lists are loaded when needed) */
   int  open();
   /* Close database */
   int  close();
-  // Prepare list for parser
-  void getList(
+  // Make journal records written so far survive a crash
+  int  checkpoint();
+  // Remember how far the walk of path went: directories up to rel_path, in
+  // walk order, are done, but for its parents (all done if rel_path is "")
+  // Call after checkpoint
+  int  setProgress(
+    const char*     prefix,
+    const char*     base_path,
+    const char*     rel_path);
+  // Get how far an interrupted walk of path went: 1 if found, 0 if not
+  int  getProgress(
+    const char*     prefix,
+    const char*     base_path,
+    string&         rel_path);
+  // Forget how far walks went, client backup is complete
+  void clearProgress(
+    const char*     prefix);
+  // Client backups, for scheduling: end of last complete one (0 if none),
+  // time it took and time spent since on incomplete ones, in seconds
+  int  getSchedule(
+    const char*     prefix,
+    time_t&         done,
+    int&            cost,
+    int&            spent);
+  int  setSchedule(
+    const char*     prefix,
+    time_t          done,
+    int             cost,
+    int             spent);
+  // Prepare list for parser, loading client's list if needed: records are
+  // not copied, and remain valid until another client's list is loaded
+  int  getList(
+    const char*     prefix,
+    const char*     base_path,
+    const char*     rel_path,
+    vector<const DbData*>& list);
+  // Records of a directory, read one at a time
+  class Cursor {
+    friend class Database;
+    char*           _dir_path;
+    int             _length;
+    size_t          _next;          // index in active list, -1 at end
+  public:
+    Cursor() : _dir_path(NULL), _length(0), _next(0) {}
+    ~Cursor() { free(_dir_path); }
+  };
+  // Same as getList, without making the list (for huge directories)
+  int  getCursor(
     const char*     prefix,
     const char*     base_path,
     const char*     rel_path,
-    list<Node*>&    list);
+    Cursor&         cursor);
+  // Next record of directory, NULL at end
+  const DbData* next(
+    Cursor&         cursor);
+  // Get client's records as they were at given date, sorted by path: all
+  // versions are read on first call, records of this run are not included,
+  // and remain valid until another client's snapshot is taken
+  int  getSnapshot(
+    const char*     prefix,
+    time_t          date,
+    vector<const DbData*>& list);
   /* Read file with given checksum, extract it to path */
   int  read(
     const string&   path,
@@ -71,12 +162,19 @@ public:
     const char*     rel_path,         // Dir (from base_path)
     const char*     dir_path,         // Local dir below file
     const Node*     node,             // File
-    const char*     checksum = NULL); // Do not copy data, use given checksum
+    const char*     checksum = NULL,  // Do not copy data, use given checksum
+    const char*     hard_link = NULL);// Path of file node is a hard link of
+  // Copy file data, for its checksum to be given to add
+  int  copy(
+    const char*     dir_path,         // Local dir below file
+    const char*     name,             // File name
+    char**          checksum,
+    int             slot = 0);        // Temporary file, for concurrent copies
   void remove(                    // Should not fail
     const char*     prefix,           // Client
     const char*     base_path,        // Path being backed up
     const char*     rel_path,         // Dir (from base_path)
-    const Node*     node);            // File
+    const char*     name);            // File name
 // For debug only
   void* active();
 };
@@ -21,64 +21,143 @@
 
 namespace hbackup {
 
+// Compact record: strings belong to the list's pool, checksums are kept as
+// binary digest and index when possible
 class DbData {
-  char*   _prefix;
-  char*   _path;
-  Node*   _node;
+  const char*   _prefix;
+  const char*   _path;
+  const char*   _extra;         // link, or checksum not in digest-index form,
+                                // or else hard link
+  long long     _size;
+  time_t        _mtime;
+  uid_t         _uid;
+  gid_t         _gid;
+  mode_t        _mode;
+  int           _index;         // checksum index, -1 if no digest
+  unsigned char _digest[16];
+  char          _type;
+  unsigned short _name;         // name offset in path
 public:
-  DbData(const DbData& data) :
-      _prefix(NULL),
-      _path(NULL),
-      _node(NULL) {
-    asprintf(&_prefix, "%s", data._prefix);
-    asprintf(&_path, "%s", data._path);
-    switch (data._node->type()) {
-      case 'l':
-        _node = new Link(*((Link*)data._node));
-        break;
-      case 'f':
-        _node = new File(*((File*)data._node));
-        break;
-      default:
-        _node = new Node(*data._node);
-    }
-  }
+  // Buffer size for checksum string
+  static const size_t checksum_size = 48;
   DbData(
       const char* prefix,
       const char* path,
-      Node*       data) :
-      _prefix(NULL),
-      _path(NULL),
-      _node(data) {
-    asprintf(&_prefix, "%s", prefix);
-    asprintf(&_path, "%s", path);
+      char        type,
+      time_t      mtime,
+      long long   size,
+      uid_t       uid,
+      gid_t       gid,
+      mode_t      mode) :
+      _prefix(prefix),
+      _path(path),
+      _extra(NULL),
+      _size(size),
+      _mtime(mtime),
+      _uid(uid),
+      _gid(gid),
+      _mode(mode),
+      _index(-1),
+      _type(type) {
+    const char* slash = strrchr(path, '/');
+    _name = (slash != NULL) ? slash - path + 1 : 0;
   }
-  ~DbData() {
-    free(_prefix);
-    free(_path);
-    free(_node);
+  // Store checksum as digest and index, fails if not exactly of that form
+  bool setDigest(const char* checksum) {
+    for (int i = 0; i < 32; i++) {
+      int value;
+      if ((checksum[i] >= '0') && (checksum[i] <= '9')) {
+        value = checksum[i] - '0';
+      } else
+      if ((checksum[i] >= 'a') && (checksum[i] <= 'f')) {
+        value = checksum[i] - 'a' + 10;
+      } else {
+        return false;
+      }
+      if (i & 1) {
+        _digest[i >> 1] |= value;
+      } else {
+        _digest[i >> 1] = value << 4;
+      }
+    }
+    const char* digits = &checksum[33];
+    if ((checksum[32] != '-') || (digits[0] < '0') || (digits[0] > '9')
+     || ((digits[0] == '0') && (digits[1] != '\0'))) {
+      return false;
+    }
+    int index = 0;
+    for (const char* digit = digits; *digit != '\0'; digit++) {
+      if ((*digit < '0') || (*digit > '9') || (index > 99999999)) {
+        return false;
+      }
+      index = index * 10 + *digit - '0';
+    }
+    _index = index;
+    return true;
   }
-  const Node* data()            { return _node; }
+  void setExtra(const char* extra) { _extra = extra; }
   const char* prefix() const    { return _prefix; }
   const char* path() const      { return _path; }
-  int pathCompare(const char* path, int length = -1) {
-    char* full_path = NULL;
-    asprintf(&full_path, "%s/%s", _prefix, _path);
-    int cmp = Node::pathCompare(full_path, path, length);
-    free(full_path);
-    return cmp;
+  const char* name() const      { return &_path[_name]; }
+  char type() const             { return _type; }
+  long long size() const        { return _size; }
+  time_t mtime() const          { return _mtime; }
+  mode_t mode() const           { return _mode; }
+  const char* link() const      { return _extra; }
+  // Path of file this one is a hard link of, NULL if none
+  const char* hardLink() const {
+    return ((_type == 'f') && (_index >= 0)) ? _extra : NULL;
+  }
+  // Checksum string, written in buffer if needed
+  const char* checksum(char* buffer) const {
+    if (_index < 0) {
+      return (_extra != NULL) ? _extra : "";
+    }
+    for (int i = 0; i < 16; i++) {
+      sprintf(&buffer[2 * i], "%02x", _digest[i]);
+    }
+    sprintf(&buffer[32], "-%d", _index);
+    return buffer;
+  }
+  // Create node from record, to be deleted by caller
+  Node* node() const {
+    char buffer[checksum_size];
+    switch (_type) {
+      case 'f': {
+        File* file = new File(_path, _type, _mtime, _size, _uid, _gid, _mode,
+          checksum(buffer));
+        file->setHardLink(hardLink());
+        return file;
+      }
+      case 'l':
+        return new Link(_path, _type, _mtime, _size, _uid, _gid, _mode,
+          _extra);
+      default:
+        return new Node(_path, _type, _mtime, _size, _uid, _gid, _mode);
+    }
+  }
+  // Same as Node::operator!=, without creating a node
+  bool operator!=(const Node& node) const {
+    return (_type != node.type())   || (_mtime != node.mtime())
+        || (_size != node.size())   || (_uid != node.uid())
+        || (_gid != node.gid())     || (_mode != node.mode())
+        || (strcmp(name(), node.name()) != 0);
   }
   void line() {
     printf("%s\t%s\t%c\t%lld\t%d\t%u\t%u\t%o",
-      _prefix, _path, _node->type(), _node->size(), _node->mtime() != 0,
-      _node->uid(), _node->gid(), _node->mode());
-    if (_node->type() == 'l') {
+      _prefix, _path, _type, _size, _mtime != 0, _uid, _gid, _mode);
+    if (_type == 'l') {
       printf("\t");
-      printf(((Link*)_node)->link());
+      printf(_extra);
     }
-    if (_node->type() == 'f') {
+    if (_type == 'f') {
+      char buffer[checksum_size];
       printf("\t");
-      printf(((File*)_node)->checksum());
+      printf(checksum(buffer));
+      if (hardLink() != NULL) {
+        printf("\t");
+        printf(hardLink());
+      }
     }
     printf("\n");
   }
@@ -19,6 +19,8 @@
 #include <iostream>
 #include <string>
 #include <list>
+#include <vector>
+#include <algorithm>
 
 #include <cctype>
 #include <cstdio>
@@ -28,6 +30,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <errno.h>
 
 // I want to use the C file functions
@@ -53,9 +56,17 @@ using namespace std;
 using namespace hbackup;
 
 void Node::metadata(const char* path) {
+  metadata(AT_FDCWD, path);
+}
+
+void Node::metadata(int dir_fd, const char* name) {
   struct stat64 metadata;
-  if (lstat64(path, &metadata)) {
-    // errno set by lstat
+  _device = 0;
+  _inode  = 0;
+  _links  = 0;
+  // Relative to directory, the kernel does not walk the whole path again
+  if (fstatat64(dir_fd, name, &metadata, AT_SYMLINK_NOFOLLOW)) {
+    // errno set by fstatat
     _type = '?';
   } else {
     if (S_ISREG(metadata.st_mode))       _type =  'f';
@@ -72,11 +83,17 @@ void Node::metadata(const char* path) {
     _uid   = metadata.st_uid;
     _gid   = metadata.st_gid;
     _mode  = metadata.st_mode & ~S_IFMT;
+    _device = metadata.st_dev;
+    _inode  = metadata.st_ino;
+    _links  = metadata.st_nlink;
   }
 }
 
 Node::Node(const char* dir_path, const char* name) {
   _parsed = false;
+  _device = 0;
+  _inode  = 0;
+  _links  = 0;
   char* full_path = path(dir_path, name);
   asprintf(&_name, "%s", basename(full_path));
   if (_name[0] == '\0') {
@@ -88,6 +105,13 @@ Node::Node(const char* dir_path, const char* name) {
   free(full_path);
 }
 
+Node::Node(int dir_fd, const char* name) {
+  _parsed = false;
+  asprintf(&_name, "%s", name);
+  errno = 0;
+  metadata(dir_fd, _name);
+}
+
 bool Node::operator!=(const Node& right) const {
   return (_type != right._type)   || (_mtime != right._mtime)
       || (_size != right._size)   || (_uid != right._uid)
@@ -165,7 +189,113 @@ int File::create(const char* dir_path) {
   return 0;
 }
 
-int Directory::createList(const char* dir_path, bool is_path) {
+// Order of nodes in lists
+static bool nodeBefore(const Node* left, const Node* right) {
+  return *left < *right;
+}
+
+// Entry of a directory, waiting for its metadata
+struct DirEntry {
+  ino_t                 ino;
+  char*                 name;
+};
+
+static bool inodeBefore(const DirEntry& left, const DirEntry& right) {
+  return left.ino < right.ino;
+}
+
+// Entries of a directory, their metadata fetched by several threads
+struct StatBatch {
+  int                   dir_fd;
+  const vector<DirEntry>* names;
+  vector<Node*>*        nodes;
+  size_t                next;         // first entry not taken yet
+  pthread_mutex_t       mutex;
+};
+
+// Entries taken at once by a thread
+static const size_t stat_batch = 32;
+
+static void* statThread(void* data) {
+  StatBatch* batch = static_cast<StatBatch*>(data);
+  while (! terminating()) {
+    pthread_mutex_lock(&batch->mutex);
+    size_t first  = batch->next;
+    batch->next  += stat_batch;
+    pthread_mutex_unlock(&batch->mutex);
+    size_t size = batch->names->size();
+    if (first >= size) {
+      break;
+    }
+    size_t last = (first + stat_batch < size) ? first + stat_batch : size;
+    for (size_t i = first; i < last; i++) {
+      (*batch->nodes)[i] = new Node(batch->dir_fd, (*batch->names)[i].name);
+    }
+  }
+  return NULL;
+}
+
+// Fetch metadata of entries, freeing their names
+static void statEntries(
+    int               dir_fd,
+    vector<DirEntry>& names,
+    vector<Node*>&    nodes,
+    int               stats,
+    bool              by_inode,
+    StatSlots*        slots) {
+  // Inodes are close on disk when their numbers are
+  if (by_inode) {
+    std::sort(names.begin(), names.end(), inodeBefore);
+  }
+  // One thread per batch of entries at most, the first one being ours
+  int extra = (names.size() + stat_batch - 1) / stat_batch;
+  if (extra > stats) {
+    extra = stats;
+  }
+  extra--;
+  if ((slots != NULL) && (extra > 0)) {
+    extra = slots->take(extra);
+  }
+  // Several lstat calls at once, for high-latency file systems
+  StatBatch batch;
+  batch.dir_fd = dir_fd;
+  batch.names  = &names;
+  batch.nodes  = &nodes;
+  batch.next   = 0;
+  pthread_mutex_init(&batch.mutex, NULL);
+  nodes.resize(names.size(), NULL);
+  vector<pthread_t> threads;
+  for (int i = 0; i < extra; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, statThread, &batch)) {
+      break;
+    }
+    threads.push_back(thread);
+  }
+  statThread(&batch);
+  for (vector<pthread_t>::iterator i = threads.begin(); i != threads.end();
+      i++) {
+    pthread_join(*i, NULL);
+  }
+  if ((slots != NULL) && (extra > 0)) {
+    slots->give(extra);
+  }
+  pthread_mutex_destroy(&batch.mutex);
+  for (size_t i = 0; i < names.size(); i++) {
+    free(names[i].name);
+  }
+  // Interrupted
+  nodes.erase(std::remove(nodes.begin(), nodes.end(), (Node*) NULL),
+    nodes.end());
+  names.clear();
+}
+
+int Directory::createList(
+    const char*   dir_path,
+    bool          is_path,
+    int           stats,
+    bool          by_inode,
+    StatSlots*    slots) {
   char* full_path;
   if (is_path) {
     full_path = path(dir_path, "");
@@ -175,22 +305,36 @@ int Directory::createList(const char* dir_path, bool is_path) {
   DIR* directory = opendir(full_path);
   if (directory == NULL) return -1;
 
+  // Collect all nodes, then sort them at once
+  vector<Node*> nodes;
+  vector<DirEntry> names;
+  int dir_fd = dirfd(directory);
   struct dirent *dir_entry;
   while (((dir_entry = readdir(directory)) != NULL) && ! terminating()) {
     // Ignore . and ..
     if (!strcmp(dir_entry->d_name, ".") || !strcmp(dir_entry->d_name, "..")) {
       continue;
     }
-    Node *g = new Node(full_path, dir_entry->d_name);
-    list<Node*>::iterator i = _nodes.begin();
-    while ((i != _nodes.end()) && (*(*i) < *g)) {
-      i++;
+    if ((stats > 1) || by_inode) {
+      // Metadata is fetched afterwards
+      DirEntry entry;
+      entry.ino  = dir_entry->d_ino;
+      entry.name = strdup(dir_entry->d_name);
+      names.push_back(entry);
+    } else {
+      nodes.push_back(new Node(dir_fd, dir_entry->d_name));
     }
-    _nodes.insert(i, g);
   }
   free(full_path);
 
+  if (! names.empty()) {
+    statEntries(dir_fd, names, nodes, stats, by_inode, slots);
+  }
   closedir(directory);
+
+  std::sort(nodes.begin(), nodes.end(), nodeBefore);
+  list<Node*> sorted(nodes.begin(), nodes.end());
+  _nodes.merge(sorted, nodeBefore);
   return 0;
 }
 
@@ -202,6 +346,205 @@ void Directory::deleteList() {
   }
 }
 
+// Run of sorted entries in a temporary file
+struct SortedDirectory::Run {
+  FILE*                 file;
+  Node*                 head;         // next entry
+};
+
+struct SortedDirectory::Private {
+  string                temp_dir;
+  size_t                run_size;
+  vector<Node*>         nodes;        // run being made, or only one
+  size_t                next;         // next node if only one run
+  vector<Run>           runs;         // heap on heads
+};
+
+// Fixed part of an entry in a run
+struct RunEntry {
+  char                  type;
+  time_t                mtime;
+  long long             size;
+  uid_t                 uid;
+  gid_t                 gid;
+  mode_t                mode;
+  dev_t                 device;
+  ino_t                 inode;
+  nlink_t               links;
+  size_t                length;       // of name
+};
+
+static int writeEntry(FILE* file, const Node* node) {
+  RunEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.type   = node->type();
+  entry.mtime  = node->mtime();
+  entry.size   = node->size();
+  entry.uid    = node->uid();
+  entry.gid    = node->gid();
+  entry.mode   = node->mode();
+  entry.device = node->device();
+  entry.inode  = node->inode();
+  entry.links  = node->links();
+  entry.length = strlen(node->name());
+  if ((fwrite(&entry, sizeof(entry), 1, file) != 1)
+   || (fwrite(node->name(), entry.length, 1, file) != 1)) {
+    return -1;
+  }
+  return 0;
+}
+
+static Node* readEntry(FILE* file) {
+  RunEntry entry;
+  if (fread(&entry, sizeof(entry), 1, file) != 1) {
+    return NULL;
+  }
+  char* name = static_cast<char*>(malloc(entry.length + 1));
+  if (fread(name, entry.length, 1, file) != 1) {
+    free(name);
+    return NULL;
+  }
+  name[entry.length] = '\0';
+  Node* node = new Node(name, entry.type, entry.mtime, entry.size, entry.uid,
+    entry.gid, entry.mode);
+  node->setInode(entry.device, entry.inode, entry.links);
+  free(name);
+  return node;
+}
+
+// Heap gives the greatest first
+bool SortedDirectory::headAfter(
+    const Run&    left,
+    const Run&    right) {
+  return *right.head < *left.head;
+}
+
+SortedDirectory::SortedDirectory(
+    const char*   temp_dir,
+    size_t        run_size) {
+  _d           = new Private;
+  _d->temp_dir = temp_dir;
+  _d->run_size = run_size;
+  _d->next     = 0;
+}
+
+SortedDirectory::~SortedDirectory() {
+  for (size_t i = _d->next; i < _d->nodes.size(); i++) {
+    delete _d->nodes[i];
+  }
+  for (vector<Run>::iterator i = _d->runs.begin(); i != _d->runs.end(); i++) {
+    delete i->head;
+    fclose(i->file);
+  }
+  delete _d;
+}
+
+int SortedDirectory::writeRun() {
+  std::sort(_d->nodes.begin(), _d->nodes.end(), nodeBefore);
+  string temp_path = _d->temp_dir + "/runXXXXXX";
+  char*  path = strdup(temp_path.c_str());
+  int    fd   = mkstemp(path);
+  Run    run;
+  run.file = NULL;
+  if (fd >= 0) {
+    // Gone with the file descriptor
+    unlink(path);
+    run.file = fdopen(fd, "w+");
+    if (run.file == NULL) {
+      close(fd);
+    }
+  }
+  int rc = (run.file != NULL) ? 0 : -1;
+  for (size_t i = 0; i < _d->nodes.size(); i++) {
+    if ((rc == 0) && writeEntry(run.file, _d->nodes[i])) {
+      rc = -1;
+    }
+    delete _d->nodes[i];
+  }
+  _d->nodes.clear();
+  if ((rc == 0) && (fflush(run.file) || fseek(run.file, 0, SEEK_SET))) {
+    rc = -1;
+  }
+  if (rc == 0) {
+    run.head = readEntry(run.file);
+    if (run.head != NULL) {
+      _d->runs.push_back(run);
+      std::push_heap(_d->runs.begin(), _d->runs.end(), headAfter);
+    } else {
+      fclose(run.file);
+    }
+  } else {
+    cerr << strerror(errno) << ": " << path << endl;
+    if (run.file != NULL) {
+      fclose(run.file);
+    }
+  }
+  free(path);
+  return rc;
+}
+
+int SortedDirectory::open(
+    const char*   dir_path,
+    int           stats,
+    StatSlots*    slots) {
+  DIR* directory = opendir(dir_path);
+  if (directory == NULL) return -1;
+
+  int rc = 0;
+  vector<DirEntry> names;
+  int dir_fd = dirfd(directory);
+  struct dirent *dir_entry;
+  while ((rc == 0) && ((dir_entry = readdir(directory)) != NULL)
+      && ! terminating()) {
+    // Ignore . and ..
+    if (!strcmp(dir_entry->d_name, ".") || !strcmp(dir_entry->d_name, "..")) {
+      continue;
+    }
+    DirEntry entry;
+    entry.ino  = dir_entry->d_ino;
+    entry.name = strdup(dir_entry->d_name);
+    names.push_back(entry);
+    if (names.size() == _d->run_size) {
+      statEntries(dir_fd, names, _d->nodes, stats, true, slots);
+      rc = writeRun();
+    }
+  }
+  if ((rc == 0) && ! names.empty()) {
+    statEntries(dir_fd, names, _d->nodes, stats, true, slots);
+    if (! _d->runs.empty()) {
+      rc = writeRun();
+    } else {
+      // All fits in memory
+      std::sort(_d->nodes.begin(), _d->nodes.end(), nodeBefore);
+    }
+  }
+  for (size_t i = 0; i < names.size(); i++) {
+    free(names[i].name);
+  }
+  closedir(directory);
+  return rc;
+}
+
+Node* SortedDirectory::next() {
+  if (_d->runs.empty()) {
+    if (_d->next < _d->nodes.size()) {
+      return _d->nodes[_d->next++];
+    }
+    return NULL;
+  }
+  std::pop_heap(_d->runs.begin(), _d->runs.end(), headAfter);
+  Run&  run  = _d->runs.back();
+  Node* node = run.head;
+  run.head = readEntry(run.file);
+  if (run.head != NULL) {
+    std::push_heap(_d->runs.begin(), _d->runs.end(), headAfter);
+  } else {
+    fclose(run.file);
+    _d->runs.pop_back();
+  }
+  return node;
+}
+
 int Directory::create(const char* dir_path) {
   errno = 0;
   char* full_path = path(dir_path, _name);
@@ -252,6 +595,14 @@ int Stream::open(const char* req_mode, unsigned int compression) {
     _fmode = O_WRONLY | O_CREAT | O_TRUNC;
     _size = 0;
     break;
+  case 'a':
+    // Not O_APPEND, which would ignore holes left by seeking
+    if (compression != 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    _fmode = O_WRONLY | O_CREAT;
+    break;
   case 'r':
     _fmode = O_RDONLY;
     break;
@@ -260,14 +611,45 @@ int Stream::open(const char* req_mode, unsigned int compression) {
     return -1;
   }
 
-  _dsize   = 0;
-  _flength = 0;
+  _dsize    = 0;
+  _flength  = 0;
+  _finished = true;
+  _holes    = false;
+  _offset   = 0;
+  _data_end = 0;
+  _dbuffer  = NULL;
   _fd = std::open64(_path, _fmode, 0666);
   if (! isOpen()) {
     // errno set by open
     return -1;
   }
 
+  if (req_mode[0] == 'a') {
+    off64_t end = lseek64(_fd, 0, SEEK_END);
+    if (end < 0) {
+      // errno set by lseek
+      std::close(_fd);
+      _fd = -1;
+      return -1;
+    }
+    _size = end;
+  } else
+  if (! isWriteable()) {
+    // Get current size, for trailer access
+    struct stat64 metadata;
+    if (! fstat64(_fd, &metadata)) {
+      _size = metadata.st_size;
+      // Fewer blocks than data: holes are not worth reading
+      _holes = (metadata.st_blocks * 512 < metadata.st_size);
+    }
+    // Check for gzip magic number, read as is if not found
+    unsigned char magic;
+    if ((compression != 0)
+     && ((pread64(_fd, &magic, 1, 0) != 1) || (magic != 0x1f))) {
+      compression = 0;
+    }
+  }
+
   // Create buffer
   _fbuffer = (unsigned char*) malloc(chunk);
 
@@ -298,6 +680,7 @@ int Stream::open(const char* req_mode, unsigned int compression) {
         cerr << "stream: inflate init failed" << endl;
         compression = 0;
       }
+      _dbuffer = (unsigned char*) malloc(chunk);
     }
   } else {
     _strm = NULL;
@@ -324,6 +707,15 @@ int Stream::close() {
     _ctx = NULL;
   }
 
+  // Holes at the end of file do not make it grow
+  if (isWriteable() && _holes) {
+    off64_t end = lseek64(_fd, 0, SEEK_CUR);
+    if ((end < 0) || ftruncate64(_fd, end)) {
+      cerr << "stream: failed to set size of " << _path << ": "
+        << strerror(errno) << endl;
+    }
+  }
+
   // Destroy zlib resources
   if (_strm != NULL) {
     if (isWriteable()) {
@@ -338,9 +730,11 @@ int Stream::close() {
   int rc = std::close(_fd);
   _fd = -1;
 
-  // Destroy buffer
+  // Destroy buffers
   free(_fbuffer);
   _fbuffer = NULL;
+  free(_dbuffer);
+  _dbuffer = NULL;
 
   // Update metadata
   metadata(_path);
@@ -363,54 +757,82 @@ ssize_t Stream::read(void* buffer, size_t count) {
 
   // Read new data
   if (_flength == 0) {
-    // Fill in buffer
-    _flength = std::read(_fd, _fbuffer, chunk);
-
-    // Check result
-    if (_flength < 0) {
-      // errno set by read
-      return -1;
-    }
+    if (_strm == NULL) {
+      // Fill in buffer
+      if (_holes) {
+        _flength = readHoles(_fbuffer, chunk);
+      } else {
+        _flength = std::read(_fd, _fbuffer, chunk);
+      }
 
-    // Update checksum with chunk
-    if (_ctx != NULL) {
-      EVP_DigestUpdate(_ctx, _fbuffer, _flength);
-    }
+      // Check result
+      if (_flength < 0) {
+        // errno set by read
+        return -1;
+      }
 
-    // Fill decompression input buffer with chunk or just return chunk
-    if (_strm != NULL) {
-      _strm->avail_in = _flength;
-      _strm->next_in  = _fbuffer;
-    } else {
+      // Update checksum with chunk
+      if (_ctx != NULL) {
+        EVP_DigestUpdate(_ctx, _fbuffer, _flength);
+      }
       _freader = _fbuffer;
+    } else {
+      // Decompress until we get some data or reach the end of the file
+      _strm->avail_out = chunk;
+      _strm->next_out  = _dbuffer;
+      while (_strm->avail_out == chunk) {
+        if (_strm->avail_in == 0) {
+          ssize_t length = std::read(_fd, _fbuffer, chunk);
+          if (length < 0) {
+            // errno set by read
+            return -1;
+          }
+          if (length == 0) {
+            // End of file, or of a truncated block
+            break;
+          }
+          // Update checksum with chunk
+          if (_ctx != NULL) {
+            EVP_DigestUpdate(_ctx, _fbuffer, length);
+          }
+          _strm->avail_in = length;
+          _strm->next_in  = _fbuffer;
+        }
+        // Start of next block, or trailing data which we ignore
+        if (_finished) {
+          if (*_strm->next_in != 0x1f) {
+            break;
+          }
+          inflateReset(_strm);
+          _finished = false;
+        }
+        switch (inflate(_strm, Z_NO_FLUSH)) {
+          case Z_STREAM_END:
+            _finished = true;
+            break;
+          case Z_NEED_DICT:
+          case Z_DATA_ERROR:
+          case Z_MEM_ERROR:
+            cerr << "stream: inflate failed" << endl;
+            errno = EUCLEAN;
+            return -1;
+        }
+      }
+      _flength = chunk - _strm->avail_out;
+      _freader = _dbuffer;
     }
   }
-  if (_strm != NULL) {
-    // Continue decompression of previous data
-    _strm->avail_out = count;
-    _strm->next_out  = (unsigned char*) buffer;
-    switch (inflate(_strm, Z_NO_FLUSH)) {
-      case Z_NEED_DICT:
-      case Z_DATA_ERROR:
-      case Z_MEM_ERROR:
-        fprintf(stderr, "File::read: inflate failed\n");
-    }
-    _flength = (_strm->avail_out == 0);
-    count -= _strm->avail_out;
-  } else {
-    if ((unsigned)_flength < count) {
-      count = _flength;
-    }
-    memcpy(buffer, _freader, count);
-    _flength -= count;
-    _freader += count;
+  if ((unsigned)_flength < count) {
+    count = _flength;
   }
+  memcpy(buffer, _freader, count);
+  _flength -= count;
+  _freader += count;
   _dsize   += count;
   return count;
 }
 
 ssize_t Stream::write(const void* buffer, size_t count) {
-  static bool finished = true;
   ssize_t length;
 
   if (! isOpen()) {
@@ -427,24 +849,22 @@ ssize_t Stream::write(const void* buffer, size_t count) {
 
   // No compression, nothing to finish
   if (_strm == NULL) {
-    finished = true;
+    _finished = true;
   }
 
   if (count == 0) {
-    if (finished) {
+    if (_finished) {
       return 0;
     }
-    finished = true;
+    _finished = true;
   } else {
-    finished = false;
+    _finished = false;
   }
 
   _dsize += count;
 
   if (_strm == NULL) {
     // Just write
-    ssize_t wlength;
-
     length = count;
 
     // Checksum computation
@@ -452,43 +872,303 @@ ssize_t Stream::write(const void* buffer, size_t count) {
       EVP_DigestUpdate(_ctx, buffer, length);
     }
 
-    do {
-      wlength = std::write(_fd, buffer, length);
-      if (wlength < 0) {
-        // errno set by write
-        return -1;
-      }
-      length -= wlength;
-    } while ((length != 0) && (wlength != 0));
+    if (writeHoles(static_cast<const unsigned char*>(buffer), length) < 0) {
+      return -1;
+    }
   } else {
     // Compress data
     _strm->avail_in = count;
     _strm->next_in  = (unsigned char*) buffer;
-    count = 0;
+    length = deflateChunks(_finished ? Z_FINISH : Z_NO_FLUSH);
+    if (length < 0) {
+      return -1;
+    }
+    count = length;
+  }
 
-    do {
-      _strm->avail_out = chunk;
-      _strm->next_out  = _fbuffer;
-      deflate(_strm, finished ? Z_FINISH : Z_NO_FLUSH);
-      length = chunk - _strm->avail_out;
-      count += length;
+  _size += count;
+  return count;
+}
 
-      // Checksum computation
-      if (_ctx != NULL) {
-        EVP_DigestUpdate(_ctx, _fbuffer, length);
+ssize_t Stream::readHoles(unsigned char* buffer, size_t count) {
+  if (_offset >= _data_end) {
+    // Where is next data?
+    off64_t data = lseek64(_fd, _offset, SEEK_DATA);
+    if ((data < 0) && (errno == ENXIO) && (_offset < _size)) {
+      // Hole until end of file
+      data = _size;
+    }
+    off64_t hole = (data == _offset) ? lseek64(_fd, _offset, SEEK_HOLE) : data;
+    if ((data < 0) || (hole < 0) || (lseek64(_fd, _offset, SEEK_SET) < 0)) {
+      // Not supported, or end of file: read on
+      _holes = false;
+      return std::read(_fd, buffer, count);
+    }
+    if (data > _offset) {
+      // Zeros, skipped
+      if ((long long) count > data - _offset) {
+        count = data - _offset;
+      }
+      memset(buffer, 0, count);
+      _offset += count;
+      if (lseek64(_fd, _offset, SEEK_SET) < 0) {
+        return -1;
       }
+      return count;
+    }
+    _data_end = hole;
+  }
+  if ((long long) count > _data_end - _offset) {
+    count = _data_end - _offset;
+  }
+  ssize_t length = std::read(_fd, buffer, count);
+  if (length > 0) {
+    _offset += length;
+  }
+  return length;
+}
+
+// Whether block only contains zeros
+static bool isZero(const unsigned char* buffer, size_t count) {
+  return (buffer[0] == 0) && (memcmp(buffer, &buffer[1], count - 1) == 0);
+}
 
-      ssize_t wlength;
+ssize_t Stream::writeHoles(const unsigned char* buffer, size_t count) {
+  size_t done = 0;
+  while (done < count) {
+    // Run of blocks of zeros, or of data (last one never is a hole)
+    bool   zero = (count - done >= hole_size) && isZero(&buffer[done],
+      hole_size);
+    size_t run  = 0;
+    do {
+      run += (count - done - run < hole_size) ? count - done - run : hole_size;
+    } while ((done + run < count)
+        && ((count - done - run >= hole_size)
+         && isZero(&buffer[done + run], hole_size)) == zero);
+    if (zero) {
+      if (lseek64(_fd, run, SEEK_CUR) < 0) {
+        // errno set by lseek
+        return -1;
+      }
+    } else {
+      const unsigned char* writer  = &buffer[done];
+      size_t               length  = run;
+      ssize_t              wlength;
       do {
-        wlength = std::write(_fd, _fbuffer, length);
+        wlength = std::write(_fd, writer, length);
         if (wlength < 0) {
           // errno set by write
           return -1;
         }
         length -= wlength;
+        writer += wlength;
       } while ((length != 0) && (wlength != 0));
-    } while (_strm->avail_out == 0);
+    }
+    _holes = zero;
+    done  += run;
+  }
+  return count;
+}
+
+ssize_t Stream::deflateChunks(int flush) {
+  ssize_t count = 0;
+  do {
+    _strm->avail_out = chunk;
+    _strm->next_out  = _fbuffer;
+    deflate(_strm, flush);
+    ssize_t length = chunk - _strm->avail_out;
+    count += length;
+
+    // Checksum computation
+    if (_ctx != NULL) {
+      EVP_DigestUpdate(_ctx, _fbuffer, length);
+    }
+
+    unsigned char* writer = _fbuffer;
+    ssize_t        wlength;
+    do {
+      wlength = std::write(_fd, writer, length);
+      if (wlength < 0) {
+        // errno set by write
+        return -1;
+      }
+      length -= wlength;
+      writer += wlength;
+    } while ((length != 0) && (wlength != 0));
+  } while (_strm->avail_out == 0);
+  return count;
+}
+
+int Stream::flush() {
+  if (! isOpen()) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (! isWriteable()) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // Nothing pending
+  if ((_strm == NULL) || _finished) {
+    return 0;
+  }
+
+  _strm->avail_in = 0;
+  ssize_t length = deflateChunks(Z_SYNC_FLUSH);
+  if (length < 0) {
+    return -1;
+  }
+  _size += length;
+  return 0;
+}
+
+int Stream::newBlock() {
+  if (! isOpen()) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (! isWriteable()) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // No compression, no blocks
+  if (_strm == NULL) {
+    return 0;
+  }
+
+  // Nothing written since last block
+  if (_finished) {
+    return 0;
+  }
+
+  // Finish compression, then start afresh
+  if (write(NULL, 0) < 0) {
+    return -1;
+  }
+  deflateReset(_strm);
+  return 0;
+}
+
+int Stream::sync() {
+  if (flush()) {
+    return -1;
+  }
+  // Holes at the end of file do not make it grow
+  if (_holes) {
+    off64_t end = lseek64(_fd, 0, SEEK_CUR);
+    if ((end < 0) || ftruncate64(_fd, end)) {
+      return -1;
+    }
+  }
+  return fdatasync(_fd);
+}
+
+int Stream::uncache() {
+  if (! isOpen()) {
+    errno = EBADF;
+    return -1;
+  }
+  int rc = posix_fadvise(_fd, 0, 0, POSIX_FADV_DONTNEED);
+  if (rc != 0) {
+    errno = rc;
+    return -1;
+  }
+  return 0;
+}
+
+int Stream::resume(Stream& copied) {
+  if (! isOpen() || ! copied.isOpen()) {
+    errno = EBADF;
+    return -1;
+  }
+  if (isWriteable() || (_strm != NULL)) {
+    errno = EINVAL;
+    return -1;
+  }
+  unsigned char buffer[chunk];
+  ssize_t       size;
+  while ((size = copied.read(buffer, chunk)) > 0) {
+    if (_ctx != NULL) {
+      EVP_DigestUpdate(_ctx, buffer, size);
+    }
+    _dsize += size;
+  }
+  if (size < 0) {
+    return -1;
   }
+  return seek(_dsize);
+}
+
+int Stream::seek(long long offset) {
+  if (! isOpen()) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (isWriteable()) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (lseek64(_fd, offset, SEEK_SET) < 0) {
+    // errno set by lseek
+    return -1;
+  }
+
+  // Drop buffered data, next read starts a new block
+  _offset   = offset;
+  _data_end = offset;
+  _flength  = 0;
+  _finished = true;
+  if (_strm != NULL) {
+    _strm->avail_in = 0;
+  }
+  return 0;
+}
+
+ssize_t Stream::readRaw(void* buffer, size_t count, long long offset) {
+  if (! isOpen()) {
+    errno = EBADF;
+    return -1;
+  }
+
+  // errno set by pread
+  return pread64(_fd, buffer, count, offset);
+}
+
+ssize_t Stream::writeRaw(const void* buffer, size_t count) {
+  if (! isOpen()) {
+    errno = EBADF;
+    return -1;
+  }
+
+  // Compression block must be finished
+  if (! isWriteable() || ((_strm != NULL) && ! _finished)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // Checksum computation
+  if (_ctx != NULL) {
+    EVP_DigestUpdate(_ctx, buffer, count);
+  }
+
+  _holes = false;
+  size_t  length = count;
+  ssize_t wlength;
+  do {
+    wlength = std::write(_fd, buffer, length);
+    if (wlength < 0) {
+      // errno set by write
+      return -1;
+    }
+    length -= wlength;
+    buffer  = &((const char*) buffer)[wlength];
+  } while ((length != 0) && (wlength != 0));
 
   _size += count;
   return count;
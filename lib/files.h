@@ -40,8 +40,13 @@ protected:
   uid_t     _uid;       // user ID of owner
   gid_t     _gid;       // group ID of owner
   mode_t    _mode;      // permissions
+  dev_t     _device;    // device and inode, to find hard links (0 if unknown)
+  ino_t     _inode;
+  nlink_t   _links;     // number of hard links
   bool      _parsed;    // more info available using proper type
   void  metadata(const char* path);
+  // Same, for a name relative to an open directory
+  void  metadata(int dir_fd, const char* name);
   const char* basename(const char* path) {
     const char* name = strrchr(path, '/');
     if (name != NULL) {
@@ -61,11 +66,16 @@ public:
         _uid(g._uid),
         _gid(g._gid),
         _mode(g._mode),
+        _device(g._device),
+        _inode(g._inode),
+        _links(g._links),
         _parsed(false) {
     asprintf(&_name, "%s", g._name);
   }
   // Constructor for path in the VFS
   Node(const char *path, const char* name = "");
+  // Constructor for entry of open directory, without building its path
+  Node(int dir_fd, const char* name);
   // Constructor for given file metadata
   Node(
       const char* name,
@@ -82,6 +92,9 @@ public:
         _uid(uid),
         _gid(gid),
         _mode(mode),
+        _device(0),
+        _inode(0),
+        _links(0),
         _parsed(false) {
     asprintf(&_name, "%s", basename(name));
   }
@@ -104,7 +117,16 @@ public:
   uid_t         uid()     const { return _uid;    }
   gid_t         gid()     const { return _gid;    }
   mode_t        mode()    const { return _mode;   }
+  dev_t         device()  const { return _device; }
+  ino_t         inode()   const { return _inode;  }
+  nlink_t       links()   const { return _links;  }
   bool          parsed()  const { return _parsed; }
+  // Set identity of node read back from elsewhere than the VFS
+  void setInode(dev_t device, ino_t inode, nlink_t links) {
+    _device = device;
+    _inode  = inode;
+    _links  = links;
+  }
   static char* path(const char* dir_path, const char* name) {
     char* full_path = NULL;
     if (dir_path[0] == '\0') {
@@ -122,24 +144,29 @@ public:
 class File : public Node {
 protected:
   char*     _checksum;
+  char*     _hard_link; // path of file this is a hard link of (NULL if none)
 public:
   // Constructor for existing Node
   File(const File& g) :
       Node(g),
-      _checksum(NULL) {
+      _checksum(NULL),
+      _hard_link(NULL) {
     _parsed = true;
     asprintf(&_checksum, "%s", g._checksum);
+    setHardLink(g._hard_link);
   }
   File(const Node& g) :
       Node(g),
-      _checksum(NULL) {
+      _checksum(NULL),
+      _hard_link(NULL) {
     _parsed = true;
     asprintf(&_checksum, "%s", "");
   }
   // Constructor for path in the VFS
   File(const char *path, const char* name = "") :
       Node(path, name),
-      _checksum(NULL) {
+      _checksum(NULL),
+      _hard_link(NULL) {
     _parsed = true;
     asprintf(&_checksum, "%s", "");
   }
@@ -154,13 +181,16 @@ public:
     mode_t      mode,
     const char* checksum) :
       Node(name, type, mtime, size, uid, gid, mode),
-      _checksum(NULL) {
+      _checksum(NULL),
+      _hard_link(NULL) {
     _parsed = true;
     setChecksum(checksum);
   }
   ~File() {
     free(_checksum);
     _checksum = NULL;
+    free(_hard_link);
+    _hard_link = NULL;
   }
   // Create empty file
   int create(const char* dir_path);
@@ -172,6 +202,21 @@ public:
     _checksum = NULL;
     asprintf(&_checksum, "%s", checksum);
   }
+  const char* hardLink() const { return _hard_link; }
+  void setHardLink(const char* hard_link) {
+    free(_hard_link);
+    _hard_link = (hard_link != NULL) ? strdup(hard_link) : NULL;
+  }
+};
+
+// Metadata calls that may be issued at once, shared by several listings
+class StatSlots {
+public:
+  virtual ~StatSlots() {}
+  // Take up to count free slots, without waiting, returning how many
+  virtual int  take(int count) = 0;
+  // Give taken slots back
+  virtual void give(int count) = 0;
 };
 
 class Directory : public Node {
@@ -198,14 +243,48 @@ public:
   }
   // Create directory
   int   create(const char* dir_path);
-  // Create list of Nodes contained in directory
-  int   createList(const char* dir_path, bool is_path = true);
+  // Create list of Nodes contained in directory, fetching metadata for up to
+  // 'stats' entries at once, in inode order if required
+  // With slots, calls beyond the first are only issued for slots taken there
+  int   createList(
+    const char*   dir_path,
+    bool          is_path  = true,
+    int           stats    = 1,
+    bool          by_inode = false,
+    StatSlots*    slots    = NULL);
   void  deleteList();
   bool  isValid() const                     { return _type == 'd'; }
   list<Node*>& nodesList()                  { return _nodes; }
   const list<Node*>& nodesListConst() const { return _nodes; }
 };
 
+// Entries of a directory too large to be kept in memory: sorted in runs
+// written to temporary files, then merged as they are read
+class SortedDirectory {
+  struct        Run;
+  struct        Private;
+  Private*      _d;
+  int  writeRun();
+  static bool headAfter(
+    const Run&    left,
+    const Run&    right);
+public:
+  // Runs are written in temp_dir, up to run_size entries each
+  SortedDirectory(
+    const char*   temp_dir,
+    size_t        run_size = default_run_size);
+  ~SortedDirectory();
+  // Read directory, fetching metadata for up to 'stats' entries at once,
+  // taking slots for calls beyond the first if given (see createList)
+  int   open(
+    const char*   dir_path,
+    int           stats = 1,
+    StatSlots*    slots = NULL);
+  // Next entry in path order, to be deleted, NULL at end
+  Node* next();
+  static const size_t default_run_size = 65536;
+};
+
 class Link : public Node {
   char*     _link;
 public:
@@ -269,15 +348,33 @@ class Stream : public File {
   mode_t          _fmode;     // file open mode
   long long       _dsize;     // uncompressed data size, in bytes
   unsigned char*  _fbuffer;   // buffer for file compression during read/write
+  unsigned char*  _dbuffer;   // buffer for decompressed data during read
   unsigned char*  _freader;   // buffer read pointer
   ssize_t         _flength;   // buffer length
+  bool            _finished;  // end of compression block reached
+  bool            _holes;     // reading: file has holes, writing: file ends
+                              // with a hole
+  long long       _offset;    // file position, when reading holes
+  long long       _data_end;  // end of data read from, when reading holes
   EVP_MD_CTX*     _ctx;       // openssl resources
   z_stream*       _strm;      // zlib resources
   // Convert MD5 to readable string
   static void md5sum(char* out, const unsigned char* in, int bytes);
+  // Compress pending data and write it to file
+  ssize_t deflateChunks(int flush);
+  // Read file, holes given as zeros without reading them
+  ssize_t readHoles(
+    unsigned char*  buffer,
+    size_t          count);
+  // Write file, leaving holes for blocks of zeros
+  ssize_t writeHoles(
+    const unsigned char* buffer,
+    size_t          count);
 public:
   // Max buffer size for read/write
   static const size_t chunk = 409600;
+  // Size of zeroed blocks left as holes when writing uncompressed data
+  static const size_t hole_size = 4096;
 //   // Constructor for existing File
 //   Stream(const File& g, const char* dir_path) {}
   // Constructor for path in the VFS
@@ -293,7 +390,9 @@ public:
   int create() {
     return File::create(_path);
   }
-  // Open file, for read or write (no append), with or without compression
+  // Open file, for read, write or append (no compression), with or without
+  // compression
+  // When reading, uncompressed data is returned as is
   int open(
     const char*     req_mode,
     unsigned int    compression = 0);
@@ -309,6 +408,30 @@ public:
   ssize_t write(
     const void*     buffer,
     size_t          count);
+  // Write all pending compressed data, so it can be read back
+  int flush();
+  // Make written data survive a crash
+  int sync();
+  // Drop file data from system cache, e.g. once read through
+  int uncache();
+  // Count data of given (open) file in checksum and carry on reading from
+  // its end, to resume a copy (no compression)
+  int resume(
+    Stream&         copied);
+  // Finish current compression block: what follows can be decompressed
+  // independently, from the current position in the file (see size())
+  int newBlock();
+  // Move read position to given offset, which must be a block start
+  int seek(
+    long long       offset);
+  // Read/write data bypassing compression, e.g. for an uncompressed trailer
+  ssize_t readRaw(
+    void*           buffer,
+    size_t          count,
+    long long       offset);
+  ssize_t writeRaw(
+    const void*     buffer,
+    size_t          count);
   // Read a line from file
   ssize_t getLine(
     String&         buffer);
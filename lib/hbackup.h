@@ -39,8 +39,13 @@ public:
   int readConfig(const char* path);
   // Check database
   int check(bool thorough = false);
-  // Backup
-  int backup(bool config_check = false);
+  // Backup, stopping cleanly at deadline if given (next backup resumes)
+  int backup(
+    bool          config_check = false,
+    time_t        deadline = 0);
+  // Back up local clients, then what changed every interval (in seconds)
+  // until terminated
+  int daemon(int interval);
 };
 
 }
@@ -18,7 +18,12 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <list>
+#include <vector>
+#include <algorithm>
+#include <time.h>
+#include <unistd.h>
 #include <errno.h>
 
 using namespace std;
@@ -36,8 +41,65 @@ struct HBackup::Private {
   Database*     db;
   list<String>  selected_clients;
   list<Client*> clients;
+  // Clients to back up (all if none added)
+  void selected(list<Client*>& clients);
+  // Order clients: least recently backed up in full first, then cheapest
+  void schedule(list<Client*>& clients);
 };
 
+void HBackup::Private::selected(list<Client*>& selection) {
+  for (list<Client*>::iterator client = clients.begin();
+      client != clients.end(); client++) {
+    // Skip unrequested clients
+    if (selected_clients.size() != 0) {
+      bool found = false;
+      for (list<String>::iterator i = selected_clients.begin();
+        i != selected_clients.end(); i++) {
+        if (*i == (*client)->name().c_str()) {
+          found = true;
+          break;
+        }
+      }
+      if (! found) {
+        continue;
+      }
+    }
+    selection.push_back(*client);
+  }
+}
+
+struct Scheduled {
+  Client*   client;
+  time_t    done;
+  int       cost;
+};
+
+static bool staler(const Scheduled& left, const Scheduled& right) {
+  if (left.done != right.done) {
+    return left.done < right.done;
+  }
+  return left.cost < right.cost;
+}
+
+void HBackup::Private::schedule(list<Client*>& selection) {
+  vector<Scheduled> scheduled;
+  for (list<Client*>::iterator client = selection.begin();
+      client != selection.end(); client++) {
+    Scheduled entry;
+    int       spent;
+    entry.client = *client;
+    db->getSchedule((*client)->prefix().c_str(), entry.done, entry.cost,
+      spent);
+    scheduled.push_back(entry);
+  }
+  stable_sort(scheduled.begin(), scheduled.end(), staler);
+  selection.clear();
+  for (vector<Scheduled>::iterator i = scheduled.begin(); i != scheduled.end();
+      i++) {
+    selection.push_back(i->client);
+  }
+}
+
 HBackup::HBackup() {
   _d                  = new Private;
   _d->default_db_path = "/backup";
@@ -167,6 +229,28 @@ int HBackup::readConfig(const char* config_path) {
               client->addOption(name, *current);
             }
           } else
+          if (keyword == "concurrency") {
+            int concurrency = 0;
+            if ((params.size() > 2)
+             || (sscanf(current->c_str(), "%d", &concurrency) != 1)
+             || (concurrency <= 0)) {
+              cerr << "Error: in file " << config_path << ", line " << line
+                << " '" << keyword << "' takes one positive number" << endl;
+              return -1;
+            }
+            client->setConcurrency(concurrency);
+          } else
+          if (keyword == "budget") {
+            int budget = 0;
+            if ((params.size() > 2)
+             || (sscanf(current->c_str(), "%d", &budget) != 1)
+             || (budget <= 0)) {
+              cerr << "Error: in file " << config_path << ", line " << line
+                << " '" << keyword << "' takes one positive number" << endl;
+              return -1;
+            }
+            client->setBudget(budget * 60);
+          } else
           if (keyword == "listfile") {
             if (params.size() > 2) {
               cerr << "Error: in file " << config_path << ", line " << line
@@ -212,38 +296,149 @@ int HBackup::check(bool thorough) {
   return -1;
 }
 
-int HBackup::backup(bool config_check) {
+int HBackup::backup(bool config_check, time_t deadline) {
+  // Only the selected clients' lists get loaded
+  list<Client*> clients;
+  _d->selected(clients);
+
+  // Time is limited: clients may not all get their turn
+  bool limited = (deadline != 0);
+  for (list<Client*>::iterator client = clients.begin();
+      client != clients.end(); client++) {
+    if ((*client)->budget() != 0) {
+      limited = true;
+    }
+  }
+
   if (! _d->db->open()) {
-    bool failed = false;
+    bool          failed = false;
+    list<string>  report;
 
-    for (list<Client*>::iterator client = _d->clients.begin();
-        client != _d->clients.end(); client++) {
+    if (limited) {
+      _d->schedule(clients);
+    }
+    int left = clients.size();
+    for (list<Client*>::iterator client = clients.begin();
+        client != clients.end(); client++, left--) {
       if (terminating()) {
         break;
       }
-      // Skip unrequested clients
-      if (_d->selected_clients.size() != 0) {
-        bool found = false;
-        for (list<String>::iterator i = _d->selected_clients.begin();
-          i != _d->selected_clients.end(); i++) {
-          if (*i == (*client)->name().c_str()) {
-            found = true;
-            break;
-          }
-        }
-        if (! found) {
-          continue;
+      // Own budget, or fair share of the time left
+      time_t start           = time(NULL);
+      time_t client_deadline = 0;
+      if ((*client)->budget() != 0) {
+        client_deadline = start + (*client)->budget();
+        if ((deadline != 0) && (client_deadline > deadline)) {
+          client_deadline = deadline;
         }
+      } else
+      if (deadline != 0) {
+        client_deadline = start + (deadline - start) / left;
+      }
+      stringstream line;
+      line << " " << (*client)->name() << ": ";
+      if ((deadline != 0) && (start >= deadline)) {
+        line << "not started, no time left";
+        report.push_back(line.str());
+        continue;
       }
+      (*client)->setDeadline(client_deadline);
       (*client)->setMountPoint(_d->db->path() + "/mount");
+      bool client_failed = false;
       if ((*client)->backup(*_d->db, config_check)) {
-        failed = true;
+        failed        = true;
+        client_failed = true;
+      }
+      int spent_now = time(NULL) - start;
+
+      // Remember how long it took
+      if (! config_check && ((*client)->paths() != 0)) {
+        time_t done;
+        int    cost;
+        int    spent;
+        _d->db->getSchedule((*client)->prefix().c_str(), done, cost, spent);
+        if ((*client)->pathsDone() == (*client)->paths()) {
+          _d->db->setSchedule((*client)->prefix().c_str(), time(NULL),
+            spent + spent_now, 0);
+        } else {
+          _d->db->setSchedule((*client)->prefix().c_str(), done, cost,
+            spent + spent_now);
+        }
       }
+
+      if (client_failed) {
+        line << "failed";
+      } else
+      if ((*client)->stopped()) {
+        line << "budget spent, to resume";
+      } else
+      if ((*client)->pathsDone() == (*client)->paths()) {
+        line << "complete";
+      } else {
+        line << "incomplete";
+      }
+      line << ", " << (*client)->pathsDone() << "/" << (*client)->paths()
+        << " paths, " << (*client)->nodes() << " nodes, " << spent_now << " s";
+      report.push_back(line.str());
     }
     _d->db->close();
+    if (limited || (verbosity() > 0)) {
+      cout << "Coverage:" << endl;
+      for (list<string>::iterator i = report.begin(); i != report.end(); i++) {
+        cout << *i << endl;
+      }
+    }
     if (failed) {
       return -1;
     }
   }
   return -1;
 }
+
+int HBackup::daemon(int interval) {
+  // Would walk all clients back to back
+  if (interval <= 0) {
+    cerr << "Wrong daemon interval: " << interval << endl;
+    return -1;
+  }
+  // Only local clients can be watched
+  list<Client*> clients;
+  _d->selected(clients);
+  for (list<Client*>::iterator client = clients.begin();
+      client != clients.end(); ) {
+    if ((*client)->protocol() != "file") {
+      if (verbosity() > 0) {
+        cout << "Not watching client '" << (*client)->name()
+          << "' using protocol '" << (*client)->protocol() << "'" << endl;
+      }
+      client = clients.erase(client);
+    } else {
+      (*client)->setWatch();
+      client++;
+    }
+  }
+  if (clients.empty()) {
+    cerr << "No local client to watch" << endl;
+    return -1;
+  }
+
+  // First backup is complete, next ones only go through changes
+  while (! terminating()) {
+    if (! _d->db->open()) {
+      for (list<Client*>::iterator client = clients.begin();
+          client != clients.end(); client++) {
+        if (terminating()) {
+          break;
+        }
+        (*client)->setMountPoint(_d->db->path() + "/mount");
+        (*client)->backup(*_d->db);
+      }
+      _d->db->close();
+    }
+    // Database may just be busy, try again later
+    for (int i = 0; (i < interval) && ! terminating(); i++) {
+      sleep(1);
+    }
+  }
+  return 0;
+}
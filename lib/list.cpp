@@ -18,8 +18,12 @@
 
 #include <iostream>
 #include <list>
+#include <vector>
+#include <algorithm>
 
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <errno.h>
 
 using namespace std;
@@ -32,10 +36,183 @@ using namespace std;
 
 using namespace hbackup;
 
-int DbList::load_v2(FILE* readfile) {
+// Cut next field at tab, or end of line (cursor is NULL once at end)
+static inline char* nextField(char** cursor) {
+  char* field = *cursor;
+  if (field != NULL) {
+    char* tab = strchr(field, '\t');
+    if (tab != NULL) {
+      *tab    = '\0';
+      *cursor = &tab[1];
+    } else {
+      *cursor = NULL;
+    }
+  }
+  return field;
+}
+
+// Whole field must be digits in given base, at most max_digits of them
+static inline bool decodeInteger(
+    const char*   field,
+    long long&    value,
+    int           base,
+    int           max_digits,
+    bool          sign = false) {
+  bool negative = false;
+  if (field == NULL) {
+    return false;
+  }
+  if (sign && (*field == '-')) {
+    negative = true;
+    field++;
+  }
+  value = 0;
+  const char* digit = field;
+  while (*digit != '\0') {
+    unsigned int n = *digit - '0';
+    if ((n >= (unsigned int) base) || (digit - field >= max_digits)) {
+      return false;
+    }
+    value = value * base + n;
+    digit++;
+  }
+  if (digit == field) {
+    return false;
+  }
+  if (negative) {
+    value = -value;
+  }
+  return true;
+}
+
+// Add text from start to end to CRC, cut fields counting as tabs
+static inline void addFields(
+    unsigned long* crc,
+    const char*   start,
+    const char*   end) {
+  while (start < end) {
+    size_t length = strlen(start);
+    *crc  = crc32(*crc, reinterpret_cast<const Bytef*>(start), length);
+    start += length;
+    if (start < end) {
+      *crc = crc32(*crc, reinterpret_cast<const Bytef*>("\t"), 1);
+      start++;
+    }
+  }
+}
+
+// Record check is exactly eight lower-case hexadecimal digits
+static inline bool decodeCheck(
+    const char*   field,
+    unsigned long& check) {
+  check = 0;
+  int i;
+  for (i = 0; field[i] != '\0'; i++) {
+    unsigned int n;
+    if ((field[i] >= '0') && (field[i] <= '9')) {
+      n = field[i] - '0';
+    } else
+    if ((field[i] >= 'a') && (field[i] <= 'f')) {
+      n = field[i] - 'a' + 10;
+    } else {
+      return false;
+    }
+    if (i >= 8) {
+      return false;
+    }
+    check = (check << 4) | n;
+  }
+  return i == 8;
+}
+
+int List::decodeData(
+    char*         line,
+    ListData&     data,
+    unsigned long* crc) {
+  char*       cursor = line;
+  const char* field;
+  long long   value;
+
+  // DB timestamp
+  if (! decodeInteger(nextField(&cursor), value, 10, 18, true)) {
+    return -1;
+  }
+  data.timestamp = value;
+  // Type
+  const char* body = cursor;
+  field = nextField(&cursor);
+  if ((field == NULL) || (field[0] == '\0') || (field[1] != '\0')) {
+    return -1;
+  }
+  data.type    = field[0];
+  data.extra     = NULL;
+  data.hard_link = NULL;
+  data.checked   = false;
+  if (data.type != '-') {
+    // Size
+    if (! decodeInteger(nextField(&cursor), value, 10, 18, true)) {
+      return -1;
+    }
+    data.size = value;
+    // Modification time
+    if (! decodeInteger(nextField(&cursor), value, 10, 18, true)) {
+      return -1;
+    }
+    data.mtime = value;
+    // User
+    if (! decodeInteger(nextField(&cursor), value, 10, 10)
+     || (value > 0xffffffffLL)) {
+      return -1;
+    }
+    data.uid = value;
+    // Group
+    if (! decodeInteger(nextField(&cursor), value, 10, 10)
+     || (value > 0xffffffffLL)) {
+      return -1;
+    }
+    data.gid = value;
+    // Permissions
+    field = nextField(&cursor);
+    if (! decodeInteger(field, value, 8, 11) || (value > 0xffffffffLL)) {
+      return -1;
+    }
+    data.mode = value;
+    // Checksum or link
+    if ((data.type == 'f') || (data.type == 'l')) {
+      field = data.extra = nextField(&cursor);
+      if (data.extra == NULL) {
+        return -1;
+      }
+    }
+    // Hard link, only if followed by the check
+    if ((data.type == 'f') && (cursor != NULL)
+     && (strchr(cursor, '\t') != NULL)) {
+      field = data.hard_link = nextField(&cursor);
+      if (data.hard_link[0] == '\0') {
+        return -1;
+      }
+    }
+  }
+  if (crc != NULL) {
+    addFields(crc, body, field + strlen(field));
+  }
+  // Record check, last if present
+  field = nextField(&cursor);
+  if (field != NULL) {
+    if ((cursor != NULL) || ! decodeCheck(field, data.check)) {
+      return -1;
+    }
+    data.checked = true;
+  }
+  return 0;
+}
+
+int DbList::load_v2(
+    List&         readfile,
+    const char*   start_prefix,
+    int           end_block) {
   /* Read the active part of the file into memory */
-  char          *buffer = NULL;
-  size_t        bsize   = 0;
+  String        line_buffer;
   unsigned int  line    = 0;
   ssize_t       size    = 0;
   int           failed  = 0;
@@ -43,13 +220,17 @@ int DbList::load_v2(FILE* readfile) {
   char*         prefix  = NULL;
   char*         path    = NULL;
 
+  bool          end_found = false;
 
-  list<DbData>::iterator  db_data;
-  bool                    end_found = false;
+  if (start_prefix != NULL) {
+    asprintf(&prefix, "%s", start_prefix);
+  }
 
   errno = 0;
-  while (((size = getline(&buffer, &bsize, readfile)) >= 0) && ! failed) {
-    char* buffer_last = &buffer[strlen(buffer) - 1];
+  while (((size = readfile.getLine(line_buffer)) > 0) && ! failed) {
+    line++;
+    char* buffer      = &line_buffer[0];
+    char* buffer_last = &buffer[size - 1];
     // Remove ending '\n'
     if (*buffer_last != '\n') {
       failed = 1;
@@ -61,118 +242,40 @@ int DbList::load_v2(FILE* readfile) {
       break;
     } else
     if (buffer[0] != '\t') {
+      if ((end_block >= 0) && readfile.startsBlock(end_block, buffer, "")) {
+        end_found = true;
+        break;
+      }
       free(prefix);
       prefix = NULL;
       asprintf(&prefix, "%s", buffer);
     } else
     if ((prefix != NULL) && (buffer[1] != '\t')) {
+      if ((end_block >= 0)
+       && readfile.startsBlock(end_block, prefix, &buffer[1])) {
+        end_found = true;
+        break;
+      }
       free(path);
       path = NULL;
       asprintf(&path, "%s", &buffer[1]);
-      db_data = end();
     } else if (path != NULL) {
-      *buffer_last = '\t';
-      char* start  = &buffer[2];
-      char* value  = (char *) malloc(size + 1);
-      int   failed = 0;
-      int   fields = 7;
-      // Fields
-      time_t    db_time;          // DB time
-      char      type;             // file type
-      time_t    mtime;            // time of last modification
-      long long size;             // on-disk size, in bytes
-      uid_t     uid;              // user ID of owner
-      gid_t     gid;              // group ID of owner
-      mode_t    mode;             // permissions
-      char*     checksum = NULL;  // file checksum
-      char*     link = NULL;      // what the link points to
-
-      for (int field = 1; field <= fields; field++) {
-        // Get tabulation position
-        char* delim = strchr(start, '\t');
-        if (delim == NULL) {
-          failed = 1;
-        } else {
-          // Get string portion
-          strncpy(value, start, delim - start);
-          value[delim - start] = '\0';
-          /* Extract data */
-          switch (field) {
-            case 1:   /* DB timestamp */
-              if (sscanf(value, "%ld", &db_time) != 1) {
-                failed = -1;
-              }
-              break;
-            case 2:   /* Type */
-              if (sscanf(value, "%c", &type) != 1) {
-                failed = 2;
-              } else if (type == '-') {
-                fields = 2;
-              } else if ((type == 'f') || (type == 'l')) {
-                fields++;
-              }
-              break;
-            case 3:   /* Size */
-              if (sscanf(value, "%lld", &size) != 1) {
-                failed = 2;
-              }
-              break;
-            case 4:   /* Modification time */
-              if (sscanf(value, "%ld", &mtime) != 1) {
-                failed = 2;
-              }
-              break;
-            case 5:   /* User */
-              if (sscanf(value, "%u", &uid) != 1) {
-                failed = 2;
-              }
-              break;
-            case 6:   /* Group */
-              if (sscanf(value, "%u", &gid) != 1) {
-                failed = 2;
-              }
-              break;
-            case 7:   /* Permissions */
-              if (sscanf(value, "%o", &mode) != 1) {
-                failed = 2;
-              }
-              break;
-            case 8:  /* Checksum or Link */
-                if (type == 'f') {
-                  checksum = value;;
-                } else if (type == 'l') {
-                  link = value;;
-                }
-              break;
-          }
-          start = delim + 1;
-        }
-        if (failed) {
-          cerr << "dblist: load: file corrupted, line " << line << endl;
-          errno = EUCLEAN;
-          break;
-        }
-      }
-      if ((type != '-') && (failed == 0)) {
-        Node* node;
-        switch (type) {
-          case 'f':
-            node = new File(path, type, mtime, size, uid, gid, mode, checksum);
-            break;
-          case 'l':
-            node = new Link(path, type, mtime, size, uid, gid, mode, link);
-            break;
-          default:
-            node = new Node(path, type, mtime, size, uid, gid, mode);
-        }
-        push_back(DbData(prefix, path, node));
+      ListData data;
+      if (List::decodeData(&buffer[2], data)) {
+        // Skip record
+        cerr << "dblist: load: file corrupted, line " << line << endl;
+        errno = EUCLEAN;
+      } else
+      if (data.type != '-') {
+        _records.push_back(make(prefix, path, data.type, data.mtime,
+          data.size, data.uid, data.gid, data.mode, data.extra,
+          data.hard_link));
       }
-      free(value);
       // Only take first file data (active)
+      free(path);
       path = NULL;
     }
   }
-  free(buffer);
   free(prefix);
   free(path);
 
@@ -185,51 +288,662 @@ int DbList::load_v2(FILE* readfile) {
   return failed;
 }
 
+// Part of a list to load, from first block until last block (excluded)
+struct Loader {
+  const char*   path;
+  const char*   filename;
+  int           first;
+  int           last;
+  DbList        list;
+  int           rc;
+  int           error;
+};
+
+void* DbList::loadThread(void* data) {
+  Loader* loader = static_cast<Loader*>(data);
+  List    readfile(loader->path, loader->filename);
+  String  prefix;
+
+  loader->rc = -1;
+  if (! readfile.open("r") && ! readfile.seekBlock(loader->first, prefix)) {
+    loader->rc = loader->list.load_v2(readfile, prefix.c_str(), loader->last);
+  }
+  loader->error = errno;
+  if (readfile.isOpen()) {
+    readfile.close();
+  }
+  return NULL;
+}
+
 int DbList::open(
     const string& path,
-    const string& filename) {
-  string source_path = path + "/" + filename;
-  bool   failed      = false;
+    const string& filename,
+    int           threads) {
+  List readfile(path.c_str(), filename.c_str());
+  bool failed = false;
 
-  FILE* readfile = fopen(source_path.c_str(), "r");
-  if (readfile == NULL) {
-    // errno set by fopen
+  if (readfile.open("r")) {
+    // errno set by open
     failed = true;
   } else {
-    /* Read the file into memory */
-    char    *buffer = NULL;
-    size_t  bsize   = 0;
+    // Share blocks between threads, when there are enough
+    int loaders = (threads > 0) ? threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (loaders > max_loaders) {
+      loaders = max_loaders;
+    }
+    if (loaders > readfile.blocks() / loader_blocks) {
+      loaders = readfile.blocks() / loader_blocks;
+    }
+    if (loaders <= 1) {
+      // errno set by load_v*
+      failed = load_v2(readfile);
+    } else {
+      // Data before the first indexed block goes to the first part
+      Loader*   parts = new Loader[loaders];
+      pthread_t threads[max_loaders];
+      bool      started[max_loaders];
+      for (int i = 0; i < loaders; i++) {
+        parts[i].path     = path.c_str();
+        parts[i].filename = filename.c_str();
+        parts[i].first    = (readfile.blocks() + 1) * i / loaders - 1;
+        parts[i].last     = (readfile.blocks() + 1) * (i + 1) / loaders - 1;
+        if (i == loaders - 1) {
+          parts[i].last = -1;
+        }
+      }
+      for (int i = 1; i < loaders; i++) {
+        started[i] = ! pthread_create(&threads[i], NULL, loadThread, &parts[i]);
+      }
+      // First part is loaded here, from current position
+      parts[0].rc    = parts[0].list.load_v2(readfile, NULL, parts[0].last);
+      parts[0].error = errno;
+      for (int i = 1; i < loaders; i++) {
+        if (started[i]) {
+          pthread_join(threads[i], NULL);
+        } else {
+          // No thread, do it here
+          loadThread(&parts[i]);
+        }
+      }
+      // Parts are in order
+      for (int i = 0; i < loaders; i++) {
+        if (parts[i].rc) {
+          failed = true;
+          errno  = parts[i].error;
+        } else {
+          append(parts[i].list);
+        }
+      }
+      delete [] parts;
+    }
+  }
+  if (readfile.isOpen()) {
+    int errno_keep = errno;
+    readfile.close();
+    errno = errno_keep;
+  }
+  if (failed) {
+    cerr << "dblist: failed to load list: " << strerror(errno) << endl;
+    return -1;
+  }
+  return 0;
+}
 
-    // errno set by load_v*
-    if (getline(&buffer, &bsize, readfile) >= 0) {
-      if (buffer[0] != '#') {
-        errno = EUCLEAN;
-        failed = true;
+int DbList::apply(
+    const string& path,
+    const string& filename) {
+  List    journal(path.c_str(), filename.c_str());
+  char*   prefix = NULL;
+  char*   fpath  = NULL;
+  Node*   node   = NULL;
+  int     rc;
+
+  if (journal.open("r")) {
+    cerr << "dblist: failed to open journal: " << strerror(errno) << endl;
+    return -1;
+  }
+  // Both are sorted, so merge them into a new array
+  vector<DbData> records;
+  records.reserve(_records.size());
+  iterator i = _records.begin();
+  while ((rc = journal.getEntry(NULL, &prefix, &fpath, &node)) > 0) {
+    int cmp = 1;
+    while (i != _records.end()) {
+      cmp = Node::pathCompare(i->prefix(), prefix);
+      if (cmp == 0) {
+        cmp = Node::pathCompare(i->path(), fpath);
+      }
+      if (cmp >= 0) {
+        break;
+      }
+      records.push_back(*i);
+      i++;
+    }
+    // Replace or remove existing record
+    if ((i != _records.end()) && (cmp == 0)) {
+      i++;
+    }
+    // Same path again in journal: last record wins
+    if (! records.empty()
+     && (strcmp(records.back().prefix(), prefix) == 0)
+     && (strcmp(records.back().path(), fpath) == 0)) {
+      records.pop_back();
+    }
+    if (node != NULL) {
+      records.push_back(make(prefix, fpath, node));
+    }
+  }
+  records.insert(records.end(), i, _records.end());
+  _records.swap(records);
+
+  int errno_keep = errno;
+  journal.close();
+  free(prefix);
+  free(fpath);
+  free(node);
+  if (rc < 0) {
+    errno = errno_keep;
+    cerr << "dblist: failed to apply journal: " << strerror(errno) << endl;
+    return -1;
+  }
+  return 0;
+}
+
+const char* DbList::store(const char* string) {
+  size_t length = strlen(string) + 1;
+  if (length > _block_free) {
+    // Blocks grow with the pool, up to a maximum size
+    size_t size = _pool_size;
+    if (size > pool_block_max) {
+      size = pool_block_max;
+    }
+    if (size < pool_block_min) {
+      size = pool_block_min;
+    }
+    if (size < length) {
+      size = length;
+    }
+    _blocks.push_back((char*) malloc(size));
+    _block_size  = size;
+    _block_free  = size;
+    _pool_size  += size;
+  }
+  char* block = &_blocks.back()[_block_size - _block_free];
+  _block_free -= length;
+  memcpy(block, string, length);
+  return block;
+}
+
+const char* DbList::intern(const char* prefix) {
+  // Records are grouped by prefix, so look from last one
+  for (list<const char*>::reverse_iterator i = _prefixes.rbegin();
+      i != _prefixes.rend(); i++) {
+    if (strcmp(*i, prefix) == 0) {
+      return *i;
+    }
+  }
+  _prefixes.push_back(store(prefix));
+  return _prefixes.back();
+}
+
+DbData DbList::make(
+    const char*   prefix,
+    const char*   path,
+    char          type,
+    time_t        mtime,
+    long long     size,
+    uid_t         uid,
+    gid_t         gid,
+    mode_t        mode,
+    const char*   extra,
+    const char*   hard_link) {
+  DbData data(intern(prefix), store(path), type, mtime, size, uid, gid, mode);
+  if (type == 'l') {
+    data.setExtra(store((extra != NULL) ? extra : ""));
+  } else
+  if ((type == 'f') && (extra != NULL) && (extra[0] != '\0')) {
+    if (! data.setDigest(extra)) {
+      data.setExtra(store(extra));
+    } else
+    if (hard_link != NULL) {
+      // Only kept with a proper checksum
+      data.setExtra(store(hard_link));
+    }
+  }
+  return data;
+}
+
+DbData DbList::make(
+    const char*   prefix,
+    const char*   path,
+    const Node*   node) {
+  const char* extra     = NULL;
+  const char* hard_link = NULL;
+  switch (node->type()) {
+    case 'f':
+      extra     = ((File*) node)->checksum();
+      hard_link = ((File*) node)->hardLink();
+      break;
+    case 'l':
+      extra = ((Link*) node)->link();
+  }
+  return make(prefix, path, node->type(), node->mtime(), node->size(),
+    node->uid(), node->gid(), node->mode(), extra, hard_link);
+}
+
+void DbList::clear() {
+  vector<DbData>().swap(_records);
+  for (list<char*>::iterator i = _blocks.begin(); i != _blocks.end(); i++) {
+    free(*i);
+  }
+  _blocks.clear();
+  _prefixes.clear();
+  _block_size = 0;
+  _block_free = 0;
+  _pool_size  = 0;
+}
+
+DbList::iterator DbList::find(
+    const char*   path,
+    bool          subtree) {
+  size_t length = strlen(path);
+  size_t first  = 0;
+  size_t count  = _records.size();
+  while (count > 0) {
+    size_t      half   = count / 2;
+    const char* middle = _records[first + half].path();
+    int         cmp    = Node::pathCompare(middle, path);
+    // Contents of a directory come right after it
+    if (subtree && (cmp > 0) && (strncmp(middle, path, length) == 0)
+     && (middle[length] == '/')) {
+      cmp = 0;
+    }
+    if ((cmp < 0) || (subtree && (cmp == 0))) {
+      first += half + 1;
+      count -= half + 1;
+    } else {
+      count  = half;
+    }
+  }
+  return _records.begin() + first;
+}
+
+void DbList::append(DbList& list) {
+  _records.insert(_records.end(), list._records.begin(), list._records.end());
+  // Keep our last block last, as we may still store strings in it
+  _blocks.splice(_blocks.begin(), list._blocks);
+  _prefixes.splice(_prefixes.end(), list._prefixes);
+  _pool_size += list._pool_size;
+  vector<DbData>().swap(list._records);
+  list._block_size = 0;
+  list._block_free = 0;
+  list._pool_size  = 0;
+}
+
+size_t DbList::memory() const {
+  return _records.capacity() * sizeof(DbData) + _pool_size;
+}
+
+// Order of records by prefix and path, then newest first
+struct DbVersions::Newer {
+  const vector<DbData>& records;
+  const vector<time_t>& timestamps;
+  Newer(const vector<DbData>& r, const vector<time_t>& t) :
+    records(r), timestamps(t) {}
+  bool operator()(size_t a, size_t b) const {
+    int cmp = Node::pathCompare(records[a].prefix(), records[b].prefix());
+    if (cmp == 0) {
+      cmp = Node::pathCompare(records[a].path(), records[b].path());
+    }
+    if (cmp != 0) {
+      return cmp < 0;
+    }
+    return timestamps[a] > timestamps[b];
+  }
+};
+
+void DbVersions::clear() {
+  _records.clear();
+  vector<time_t>().swap(_timestamps);
+  vector<size_t>().swap(_paths);
+  _sorted = true;
+}
+
+int DbVersions::add(
+    const string& path,
+    const string& filename) {
+  List    readfile(path.c_str(), filename.c_str());
+  String  line_buffer;
+  ssize_t size;
+  char*   prefix = NULL;
+  char*   fpath  = NULL;
+  bool    end_found = false;
+
+  if (readfile.open("r")) {
+    cerr << "dbversions: failed to open " << filename << ": "
+      << strerror(errno) << endl;
+    return -1;
+  }
+  errno = 0;
+  while ((size = readfile.getLine(line_buffer)) > 0) {
+    char* buffer = &line_buffer[0];
+    if (buffer[size - 1] != '\n') {
+      break;
+    }
+    buffer[size - 1] = '\0';
+    if (buffer[0] == '#') {
+      end_found = true;
+      break;
+    } else
+    if (buffer[0] != '\t') {
+      free(prefix);
+      prefix = NULL;
+      asprintf(&prefix, "%s", buffer);
+    } else
+    if (buffer[1] != '\t') {
+      free(fpath);
+      fpath = NULL;
+      asprintf(&fpath, "%s", &buffer[1]);
+    } else
+    if ((prefix != NULL) && (fpath != NULL)) {
+      ListData data;
+      if (List::decodeData(&buffer[2], data)) {
+        cerr << "dbversions: skipping corrupted record for " << fpath << endl;
+        continue;
+      }
+      DbData record = (data.type == '-')
+        ? _records.make(prefix, fpath, '-', 0, 0, 0, 0, 0, NULL)
+        : _records.make(prefix, fpath, data.type, data.mtime, data.size,
+            data.uid, data.gid, data.mode, data.extra, data.hard_link);
+      _records._records.push_back(record);
+      _timestamps.push_back(data.timestamp);
+    }
+  }
+  readfile.close();
+  free(prefix);
+  free(fpath);
+  _sorted = false;
+  if (! end_found) {
+    cerr << "dbversions: end of " << filename << " not found" << endl;
+    errno = EUCLEAN;
+    return -1;
+  }
+  return 0;
+}
+
+void DbVersions::sort() {
+  if (_sorted) {
+    return;
+  }
+  vector<DbData>& records = _records._records;
+  vector<size_t>  order(records.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), Newer(records, _timestamps));
+
+  vector<DbData> sorted_records;
+  vector<time_t> sorted_timestamps;
+  sorted_records.reserve(records.size());
+  sorted_timestamps.reserve(records.size());
+  _paths.clear();
+  for (size_t i = 0; i < order.size(); i++) {
+    const DbData& record = records[order[i]];
+    if (sorted_records.empty()
+     || (strcmp(sorted_records.back().path(), record.path()) != 0)
+     || (sorted_records.back().prefix() != record.prefix())) {
+      _paths.push_back(i);
+    }
+    sorted_records.push_back(record);
+    sorted_timestamps.push_back(_timestamps[order[i]]);
+  }
+  _paths.push_back(order.size());
+  records.swap(sorted_records);
+  _timestamps.swap(sorted_timestamps);
+  _sorted = true;
+}
+
+size_t DbVersions::paths() {
+  sort();
+  return _paths.empty() ? 0 : _paths.size() - 1;
+}
+
+void DbVersions::snapshot(
+    const char*   prefix,
+    time_t        date,
+    vector<const DbData*>& records) {
+  sort();
+  for (size_t p = 0; (p + 1) < _paths.size(); p++) {
+    size_t first = _paths[p];
+    if (strcmp(_records._records[first].prefix(), prefix) != 0) {
+      continue;
+    }
+    // First record not after date, newest first
+    size_t count = _paths[p + 1] - first;
+    while (count > 0) {
+      size_t half = count / 2;
+      if (_timestamps[first + half] > date) {
+        first += half + 1;
+        count -= half + 1;
       } else {
-        // Version 2
-        failed = load_v2(readfile);
+        count  = half;
+      }
+    }
+    if ((first < _paths[p + 1]) && (_records._records[first].type() != '-')) {
+      records.push_back(&_records._records[first]);
+    }
+  }
+}
+
+int List::putLine(
+    const char*   line,
+    size_t        length) {
+  if (_active_only && (line[0] == '\t')) {
+    // Path: wait for its data
+    if (line[1] != '\t') {
+      _pending = String(line, length);
+      return 0;
+    }
+    // Data: only the first one counts, and only if not removed
+    if (_pending.length() == 0) {
+      return 0;
+    }
+    const char* type = strchr(&line[2], '\t');
+    if ((type != NULL) && (type[1] == '-')
+     && ((type[2] == '\t') || (type[2] == '\n'))) {
+      _pending = "";
+      return 0;
+    }
+    int rc = writeLine(_pending.c_str(), _pending.length());
+    _pending = "";
+    if (rc) {
+      return -1;
+    }
+  }
+  return writeLine(line, length);
+}
+
+int List::writeLine(
+    const char*   line,
+    size_t        length) {
+  bool is_prefix = (line[0] != '\t') && (line[0] != '#');
+  bool is_path   = (line[0] == '\t') && (line[1] != '\t');
+
+  // Journals repeat the prefix for each record: not a prefix start
+  if (is_prefix && (_prefix.length() == (int) length - 1)
+   && (strncmp(_prefix.c_str(), line, length - 1) == 0)) {
+    is_prefix = false;
+  }
+
+  // Blocks start at a prefix or a path, so they can be read on their own
+  if ((_block_size > 0) && (is_prefix || is_path)
+   && (_block_data >= _block_size)) {
+    if (writeBuffer() || newBlock()) {
+      return -1;
+    }
+    Block block;
+    block.offset = size();
+    _block_data  = 0;
+    if (is_prefix) {
+      block.prefix = String(line, length - 1);
+    } else {
+      block.prefix = _prefix;
+      block.path   = String(&line[1], length - 2);
+      // Repeat prefix
+      String prefix_line = _prefix + "\n";
+      if (bufferWrite(prefix_line.c_str(), prefix_line.length())) {
+        return -1;
       }
+      _block_data += prefix_line.length();
+    }
+    _index.push_back(block);
+  }
+  if (is_prefix) {
+    _prefix = String(line, length - 1);
+  }
+  _block_data += length;
+  return bufferWrite(line, length);
+}
+
+int List::bufferWrite(
+    const char*   data,
+    size_t        length) {
+  if (_wlength + length > write_buffer_size) {
+    if (writeBuffer()) {
+      return -1;
+    }
+    // Too big to buffer
+    if (length > write_buffer_size) {
+      return (write(data, length) < 0) ? -1 : 0;
     }
+  }
+  memcpy(&_wbuffer[_wlength], data, length);
+  _wlength += length;
+  return 0;
+}
+
+int List::writeBuffer() {
+  if (_wlength == 0) {
+    return 0;
+  }
+  ssize_t rc = write(_wbuffer, _wlength);
+  _wlength = 0;
+  return (rc < 0) ? -1 : 0;
+}
+
+// Trailer: '# index ' then offset of index on 20 digits, then '\n'
+static const size_t index_trailer = 29;
+
+int List::loadIndex() {
+  _index.clear();
+  if (size() <= (long long) index_trailer) {
+    return 0;
+  }
+
+  char      trailer[index_trailer + 1];
+  long long offset;
+  if (readRaw(trailer, index_trailer, size() - index_trailer)
+      != (ssize_t) index_trailer) {
+    return -1;
+  }
+  trailer[index_trailer] = '\0';
+  if (strncmp(trailer, "# index ", 8)
+   || (sscanf(&trailer[8], "%lld", &offset) != 1)
+   || (offset < 0) || (offset >= size() - (long long) index_trailer)) {
+    // No index
+    return 0;
+  }
+
+  size_t length = size() - index_trailer - offset;
+  char*  buffer = (char*) malloc(length + 1);
+  if (readRaw(buffer, length, offset) != (ssize_t) length) {
     free(buffer);
-    fclose(readfile);
+    return -1;
   }
-  if (failed) {
-    cerr << "dblist: failed to load list: " << strerror(errno) << endl;
+  buffer[length] = '\0';
+
+  // Skip index header line
+  char* line = strchr(buffer, '\n');
+  while ((line != NULL) && (*++line != '\0')) {
+    char* end    = strchr(line, '\n');
+    char* prefix = strchr(line, '\t');
+    char* path   = (prefix != NULL) ? strchr(&prefix[1], '\t') : NULL;
+    if ((end == NULL) || (path == NULL) || (path > end)) {
+      cerr << "list: index corrupted, ignoring" << endl;
+      _index.clear();
+      break;
+    }
+    *prefix++ = '\0';
+    *path++   = '\0';
+    *end      = '\0';
+    Block block;
+    block.offset = strtoll(line, NULL, 10);
+    block.prefix = prefix;
+    block.path   = path;
+    _index.push_back(block);
+    line = end;
+  }
+  free(buffer);
+  return 0;
+}
+
+int List::saveIndex() {
+  if (_index.empty()) {
+    return 0;
+  }
+
+  long long offset = size();
+  String    index  = "# index\n";
+  for (vector<Block>::iterator i = _index.begin(); i != _index.end(); i++) {
+    char* line = NULL;
+    asprintf(&line, "%lld\t%s\t%s\n", i->offset, i->prefix.c_str(),
+      i->path.c_str());
+    index += line;
+    free(line);
+    // Flush from time to time
+    if ((size_t) index.length() >= chunk) {
+      if (writeRaw(index.c_str(), index.length()) < 0) {
+        return -1;
+      }
+      index = "";
+    }
+  }
+  char trailer[index_trailer + 1];
+  sprintf(trailer, "# index %020lld\n", offset);
+  index += trailer;
+  if (writeRaw(index.c_str(), index.length()) < 0) {
     return -1;
   }
   return 0;
 }
 
 int List::open(
-    const char* req_mode) {
+    const char*   req_mode,
+    unsigned int  compression,
+    size_t        block_size) {
   const char header[] = "# version 2\n";
   int rc = 0;
 
-  if (Stream::open(req_mode, 0)) {
+  _index.clear();
+  _prefix      = "";
+  _pending     = "";
+  // Blocks can only be read on their own when compressed
+  _block_size  = (compression != 0) ? block_size : 0;
+  _block_data  = 0;
+  _unflushed   = 0;
+  _wlength     = 0;
+  _prefix_crc  = 0;
+  _path_crc    = 0;
+
+  // Compressed lists are detected when reading
+  if (Stream::open(req_mode, (req_mode[0] == 'w') ? compression : 1)) {
     rc = -1;
   } else
   if (isWriteable()) {
-    if (write(header, strlen(header)) < 0) {
+    if (_wbuffer == NULL) {
+      _wbuffer = (char*) malloc(write_buffer_size);
+    }
+    if (putLine(header, strlen(header))) {
       Stream::close();
       rc = -1;
     }
@@ -241,6 +955,10 @@ int List::open(
     if (_line != header) {
       errno = EUCLEAN;
       rc = -1;
+    } else
+    if (loadIndex()) {
+      cerr << "list: cannot read index, ignoring" << endl;
+      _index.clear();
     }
   }
   _line_status = 0;
@@ -252,13 +970,17 @@ int List::close() {
   int rc = 0;
 
   if (isWriteable()) {
-    if (Stream::write(footer, strlen(footer)) < 0) {
+    if (putLine(footer, strlen(footer)) || writeBuffer() || newBlock()
+     || saveIndex()) {
       rc = -1;
     }
   }
   if (Stream::close()) {
     rc = -1;
   }
+  free(_wbuffer);
+  _wbuffer = NULL;
+  _wlength = 0;
   return rc;
 }
 
@@ -281,8 +1003,49 @@ ssize_t List::nextLine() {
   return length;
 }
 
+int List::seekBlock(
+    int           block,
+    String&       prefix) {
+  if ((block < 0) || (block >= (int) _index.size())) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (seek(_index[block].offset)) {
+    return -1;
+  }
+  prefix       = _index[block].prefix;
+  _line_status = 0;
+  return 0;
+}
+
+bool List::startsBlock(
+    int           block,
+    const char*   prefix,
+    const char*   path) const {
+  const Block& start = _index[block];
+  return (strcmp(start.path.c_str(), path) == 0)
+      && (strcmp(start.prefix.c_str(), prefix) == 0);
+}
+
 bool List::findPrefix(const char* prefix_in) {
   StrPath prefix(prefix_in);
+
+  // Jump to last block starting before prefix, or at it
+  vector<Block>::iterator block = _index.end();
+  for (vector<Block>::iterator i = _index.begin(); i != _index.end(); i++) {
+    int cmp = prefix.compare(i->prefix);
+    if ((cmp < 0) || ((cmp == 0) && (i->path.length() != 0))) {
+      break;
+    }
+    block = i;
+  }
+  if (block != _index.end()) {
+    if (seek(block->offset)) {
+      return false;
+    }
+    _line_status = 0;
+  }
+
   prefix += "\n";
   bool    found  = false;
   while ((nextLine() > 0) && (_line[0] != '#')) {
@@ -297,6 +1060,44 @@ bool List::findPrefix(const char* prefix_in) {
   return found;
 }
 
+int List::nextPrefix(
+    String&       prefix) {
+  ssize_t rc = (_line_status == 1) ? currentLine() : nextLine();
+  if ((rc <= 0) || (_line[rc - 1] != '\n')) {
+    errno = EUCLEAN;
+    return -1;
+  }
+  if (_line[0] == '#') {
+    return 0;
+  }
+  if (_line[0] == '\t') {
+    // Records without prefix
+    errno = EUCLEAN;
+    return -1;
+  }
+  prefix = String(_line.c_str(), rc - 1);
+  _line_status = 1;
+  return 1;
+}
+
+int List::copyPrefix(
+    List&         list) {
+  ssize_t rc = list.currentLine();
+  do {
+    if ((rc <= 0) || (list._line[rc - 1] != '\n')) {
+      cerr << "Corrupted line in list" << endl;
+      errno = EUCLEAN;
+      return -1;
+    }
+    if (putLine(list._line.c_str(), list._line.length())) {
+      return -1;
+    }
+    rc = list.nextLine();
+  } while ((rc > 0) && (list._line[0] == '\t'));
+  list._line_status = 1;
+  return (rc < 0) ? -1 : 0;
+}
+
 int List::getEntry(
     time_t*   timestamp,
     char**    prefix,
@@ -339,6 +1140,10 @@ int List::getEntry(
 
     // Prefix
     if (_line[0] != '\t') {
+      _prefix_crc = crc32(crc32(0, NULL, 0),
+        reinterpret_cast<const Bytef*>(&_line[0]), length);
+      _prefix_crc = crc32(_prefix_crc,
+        reinterpret_cast<const Bytef*>("\n"), 1);
       if (prefix != NULL) {
         free(*prefix);
         *prefix = NULL;
@@ -348,6 +1153,9 @@ int List::getEntry(
 
     // Path
     if (_line[1] != '\t') {
+      _path_crc = crc32(_prefix_crc,
+        reinterpret_cast<const Bytef*>(&_line[0]), length);
+      _path_crc = crc32(_path_crc, reinterpret_cast<const Bytef*>("\n"), 1);
       if (path != NULL) {
         free(*path);
         *path = NULL;
@@ -358,99 +1166,41 @@ int List::getEntry(
     // Data
     {
       if (node != NULL) {
-        _line[length] = '\t';
-        char*     start  = &_line[2];
-        int       fields = 7;
-        // Fields
-        char      type;             // file type
-        time_t    mtime;            // time of last modification
-        long long size;             // on-disk size, in bytes
-        uid_t     uid;              // user ID of owner
-        gid_t     gid;              // group ID of owner
-        mode_t    mode;             // permissions
-        char*     checksum = NULL;  // file checksum
-        char*     link     = NULL;  // what the link points to
-
-        for (int field = 1; field <= fields; field++) {
-          // Get tabulation position
-          char* delim = strchr(start, '\t');
-          if (delim == NULL) {
-            errno = EUCLEAN;
-          } else {
-            *delim = '\0';
-            /* Extract data */
-            switch (field) {
-              case 1:   /* DB timestamp */
-                if ((timestamp != NULL)
-                 && sscanf(start, "%ld", timestamp) != 1) {
-                  errno = EUCLEAN;
-                }
-                break;
-              case 2:   /* Type */
-                if (sscanf(start, "%c", &type) != 1) {
-                  errno = EUCLEAN;;
-                } else if (type == '-') {
-                  fields = 2;
-                } else if ((type == 'f') || (type == 'l')) {
-                  fields++;
-                }
-                break;
-              case 3:   /* Size */
-                if (sscanf(start, "%lld", &size) != 1) {
-                  errno = EUCLEAN;;
-                }
-                break;
-              case 4:   /* Modification time */
-                if (sscanf(start, "%ld", &mtime) != 1) {
-                  errno = EUCLEAN;;
-                }
-                break;
-              case 5:   /* User */
-                if (sscanf(start, "%u", &uid) != 1) {
-                  errno = EUCLEAN;;
-                }
-                break;
-              case 6:   /* Group */
-                if (sscanf(start, "%u", &gid) != 1) {
-                  errno = EUCLEAN;;
-                }
-                break;
-              case 7:   /* Permissions */
-                if (sscanf(start, "%o", &mode) != 1) {
-                  errno = EUCLEAN;;
-                }
-                break;
-              case 8:  /* Checksum or Link */
-                  if (type == 'f') {
-                    checksum = start;
-                  } else if (type == 'l') {
-                    link = start;
-                  }
-                break;
-              default:
-                errno = EUCLEAN;;
-            }
-            start = delim + 1;
-          }
-          if (errno != 0) {
-            cerr << "dblist: file corrupted line " << _line.c_str() << endl;
-            errno = EUCLEAN;
-            break;
+        ListData      data;
+        unsigned long crc = _path_crc;
+        if (decodeData(&_line[2], data, &crc)) {
+          cerr << "dblist: file corrupted line " << _line.c_str() << endl;
+          errno = EUCLEAN;
+          break;
+        }
+        if (data.checked && (data.check != (crc & 0xffffffffUL))) {
+          cerr << "dblist: record check failed";
+          if ((path != NULL) && (*path != NULL)) {
+            cerr << " for " << *path;
           }
+          cerr << endl;
+          errno = EUCLEAN;
+          break;
         }
-        switch (type) {
+        if (timestamp != NULL) {
+          *timestamp = data.timestamp;
+        }
+        switch (data.type) {
           case '-':
             *node = NULL;
             break;
           case 'f':
-            *node = new File(*path, type, mtime, size, uid, gid, mode,
-              checksum);
+            *node = new File(*path, data.type, data.mtime, data.size,
+              data.uid, data.gid, data.mode, data.extra);
+            ((File*) *node)->setHardLink(data.hard_link);
             break;
           case 'l':
-            *node = new Link(*path, type, mtime, size, uid, gid, mode, link);
+            *node = new Link(*path, data.type, data.mtime, data.size,
+              data.uid, data.gid, data.mode, data.extra);
             break;
           default:
-            *node = new Node(*path, type, mtime, size, uid, gid, mode);
+            *node = new Node(*path, data.type, data.mtime, data.size,
+              data.uid, data.gid, data.mode);
         }
       }
       done = true;
@@ -475,54 +1225,106 @@ int List::getEntry(
   return 1;
 }
 
+int List::putData(
+    const char*   prefix,
+    const char*   path,
+    const String& data,
+    time_t        timestamp) {
+  // Check covers the prefix, path and data lines, but not the timestamp
+  unsigned long crc = crc32(0, NULL, 0);
+  crc = crc32(crc, reinterpret_cast<const Bytef*>(prefix), strlen(prefix));
+  crc = crc32(crc, reinterpret_cast<const Bytef*>("\n\t"), 2);
+  crc = crc32(crc, reinterpret_cast<const Bytef*>(path), strlen(path));
+  crc = crc32(crc, reinterpret_cast<const Bytef*>("\n"), 1);
+  crc = crc32(crc, reinterpret_cast<const Bytef*>(data.c_str()),
+    data.length());
+  char number[32];
+  sprintf(number, "\t\t%ld\t", (timestamp >= 0) ? timestamp : time(NULL));
+  String line = number;
+  line += data;
+  sprintf(number, "\t%08lx\n", crc & 0xffffffffUL);
+  line += number;
+  int rc = putLine(line.c_str(), line.length());
+  // Make records readable in case of crash, now and then
+  if (++_unflushed >= checkpoint_records) {
+    if (checkpoint()) {
+      rc = -1;
+    }
+  }
+  return rc;
+}
+
 int List::added(
     const char* prefix,
     const char* path,
     const Node* node,
     time_t      timestamp) {
-  Stream::write(prefix, strlen(prefix));
-  Stream::write("\n\t", 2);
-  Stream::write(path, strlen(path));
-  Stream::write("\n", 1);
-  char* line = NULL;
-  int size = asprintf(&line, "\t\t%ld\t%c\t%lld\t%ld\t%u\t%u\t%o",
-    (timestamp >= 0) ? timestamp : time(NULL), node->type(), node->size(),
+  int    rc   = 0;
+  String line = prefix;
+  line += "\n";
+  if (putLine(line.c_str(), line.length())) {
+    rc = -1;
+  }
+  line = "\t";
+  line += path;
+  line += "\n";
+  if (putLine(line.c_str(), line.length())) {
+    rc = -1;
+  }
+  char data[80];
+  sprintf(data, "%c\t%lld\t%ld\t%u\t%u\t%o", node->type(), node->size(),
     node->mtime(), node->uid(), node->gid(), node->mode());
-  Stream::write(line, size);
-  free(line);
+  line = data;
   switch (node->type()) {
     case 'f':
-      Stream::write("\t", 1);
-      {
-        const char* checksum = ((File*) node)->checksum();
-        Stream::write(checksum, strlen(checksum));
+      line += "\t";
+      line += ((File*) node)->checksum();
+      if (((File*) node)->hardLink() != NULL) {
+        line += "\t";
+        line += ((File*) node)->hardLink();
       }
       break;
     case 'l':
-      Stream::write("\t", 1);
-      {
-        const char* link = ((Link*) node)->link();
-        Stream::write(link, strlen(link));
-      }
+      line += "\t";
+      line += ((Link*) node)->link();
   }
-  Stream::write("\n", 1);
-  return 0;
+  if (putData(prefix, path, line, timestamp)) {
+    rc = -1;
+  }
+  return rc;
 }
 
 int List::removed(
     const char*   prefix,
     const char*   path,
     time_t        timestamp) {
-  Stream::write(prefix, strlen(prefix));
-  Stream::write("\n\t", 2);
-  Stream::write(path, strlen(path));
-  Stream::write("\n", 1);
-  char* line = NULL;
-  int size = asprintf(&line, "\t\t%ld\t-\n",
-    (timestamp >= 0) ? timestamp : time(NULL));
-  Stream::write(line, size);
-  free(line);
-  return 0;
+  int    rc   = 0;
+  String line = prefix;
+  line += "\n";
+  if (putLine(line.c_str(), line.length())) {
+    rc = -1;
+  }
+  line = "\t";
+  line += path;
+  line += "\n";
+  if (putLine(line.c_str(), line.length())) {
+    rc = -1;
+  }
+  if (putData(prefix, path, "-", timestamp)) {
+    rc = -1;
+  }
+  return rc;
+}
+
+int List::checkpoint() {
+  if ((_unflushed == 0) && (_wlength == 0)) {
+    return 0;
+  }
+  _unflushed = 0;
+  if (writeBuffer()) {
+    return -1;
+  }
+  return flush();
 }
 
 int List::copyUntil(
@@ -557,6 +1359,20 @@ int List::copyUntil(
       break;
     }
 
+    // Exception not followed by the data it applies to, keep it as is
+    if ((exception_line != NULL)
+     && ((list._line[0] != '\t') || (list._line[1] != '\t'))) {
+      String line = "\t\t0\t";
+      line += exception_line;
+      free(exception_line);
+      exception_line = NULL;
+      if (putLine(line.c_str(), line.length())) {
+        // Could not write
+        rc = -1;
+        break;
+      }
+    }
+
     // End of file
     if (list._line[0] == '#') {
       rc = 0;
@@ -574,7 +1390,7 @@ int List::copyUntil(
 
     // Full copy
     if (prefix_l.length() == 0) {
-      if (write(list._line.c_str(), list._line.length()) < 0) {
+      if (putLine(list._line.c_str(), list._line.length())) {
         // Could not write
         rc = -1;
         break;
@@ -587,7 +1403,7 @@ int List::copyUntil(
       *prefix_cmp = prefix_l.compare(list._line);
       if (*prefix_cmp > 0)  {
         // Our prefix is here or after, so let's copy
-        if (write(list._line.c_str(), list._line.length()) < 0) {
+        if (putLine(list._line.c_str(), list._line.length())) {
           // Could not write
           rc = -1;
           break;
@@ -607,7 +1423,7 @@ int List::copyUntil(
 
     // Looking for prefix
     if ((path_l.length() == 0) || (*prefix_cmp > 0)) {
-      if (write(list._line.c_str(), list._line.length()) < 0) {
+      if (putLine(list._line.c_str(), list._line.length())) {
         // Could not write
         rc = -1;
         break;
@@ -620,7 +1436,7 @@ int List::copyUntil(
       path_cmp = path_l.compare(list._line);
       if (path_cmp > 0) {
         // Our path is here or after, so let's copy
-        if (write(list._line.c_str(), list._line.length()) < 0) {
+        if (putLine(list._line.c_str(), list._line.length())) {
           // Could not write
           rc = -1;
           break;
@@ -648,14 +1464,10 @@ int List::copyUntil(
           rc    = -1;
           break;
         }
-        // Write first part from second line
-        if (write(list._line.c_str(), pos - list._line.c_str() + 1) < 0) {
-          // Could not write
-          rc = -1;
-          break;
-        }
-        // Write end of fisrt line
-        if (write(exception_line, strlen(exception_line)) < 0) {
+        // Write first part from second line, then end of first line
+        String line(list._line.c_str(), pos - list._line.c_str() + 1);
+        line += exception_line;
+        if (putLine(line.c_str(), line.length())) {
           // Could not write
           rc = -1;
           break;
@@ -669,7 +1481,7 @@ int List::copyUntil(
         asprintf(&exception_line, "%s", &list._line[4]);
       } else
       // Our prefix and path are after, so let's copy
-      if (write(list._line.c_str(), list._line.length() ) < 0) {
+      if (putLine(list._line.c_str(), list._line.length())) {
         // Could not write
         rc = -1;
         break;
@@ -834,7 +1646,7 @@ int List::merge(List& list, List& journal) {
     }
 
     // Copy journal line
-    if (write(journal._line.c_str(), journal._line.length()) < 0) {
+    if (putLine(journal._line.c_str(), journal._line.length())) {
       // Could not write
       cerr << "Journal copy failed" << endl;
       rc = -1;
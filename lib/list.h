@@ -21,19 +21,176 @@
 
 namespace hbackup {
 
-class DbList : public list<DbData> {
+class List;
+
+// Fields of a data line, as decoded by List::decodeData
+struct ListData {
+  time_t        timestamp;
+  char          type;
+  long long     size;
+  time_t        mtime;
+  uid_t         uid;
+  gid_t         gid;
+  mode_t        mode;
+  const char*   extra;        // checksum or link, in line (NULL if none)
+  const char*   hard_link;    // path of file this one is a hard link of, in
+                              // line, before the check (NULL if none)
+  bool          checked;      // record check present
+  unsigned long check;        // CRC32 of prefix, path and data lines
+};
+
+class DbList {
+  // Records are kept in one array, their strings in large pool blocks, and
+  // prefixes are only stored once
+  vector<DbData>    _records;
+  list<char*>       _blocks;
+  size_t            _block_size;    // size of last block
+  size_t            _block_free;    // space left in last block
+  size_t            _pool_size;     // total size of blocks
+  list<const char*> _prefixes;
+  static const size_t pool_block_min = 4096;
+  static const size_t pool_block_max = 1048576;
+  // Threads for loading, and minimum number of blocks for each
+  static const int    max_loaders    = 8;
+  static const int    loader_blocks  = 4;
+  DbList(const DbList&);
+  DbList& operator=(const DbList&);
+  friend class DbVersions;
+  // Copy string into pool
+  const char* store(
+    const char*   string);
+  // Get stored prefix, storing it if needed
+  const char* intern(
+    const char*   prefix);
+  // Create record, its strings stored in pool
+  DbData make(
+    const char*   prefix,
+    const char*   path,
+    char          type,
+    time_t        mtime,
+    long long     size,
+    uid_t         uid,
+    gid_t         gid,
+    mode_t        mode,
+    const char*   extra,
+    const char*   hard_link = NULL);
+  DbData make(
+    const char*   prefix,
+    const char*   path,
+    const Node*   node);
+  // Load records, from current position until end of list or given block
   int  load_v2(
-    FILE*         readfile);
+    List&         readfile,
+    const char*   start_prefix = NULL,
+    int           end_block    = -1);
+  // Load part of list (see open)
+  static void* loadThread(
+    void*         data);
 public:
+  typedef vector<DbData>::iterator iterator;
+  DbList() :
+    _block_size(0),
+    _block_free(0),
+    _pool_size(0) {}
+  ~DbList() { clear(); }
+  iterator begin()      { return _records.begin(); }
+  iterator end()        { return _records.end(); }
+  size_t size() const   { return _records.size(); }
+  void clear();
+  // Binary search for first record whose path is not before given path, or
+  // with subtree set, not before nor below it (records must share a prefix)
+  iterator find(
+    const char*   path,
+    bool          subtree = false);
+  // Large lists are loaded by several threads, cutting at block boundaries
+  // (default: one per processor)
   int  open(
+    const string& path,
+    const string& filename,
+    int           threads = 0);
+  // Apply records from journal, which must be sorted like the list
+  int  apply(
     const string& path,
     const string& filename);
+  // Move all records of given list to the end of this one
+  void append(
+    DbList&       list);
+  // Memory used by records and strings, in bytes
+  size_t memory() const;
+};
+
+// All versions of records, read from any lists and journals, to get the
+// contents at a given time: records are sorted by path then newest first, so
+// a snapshot only costs a binary search per path
+class DbVersions {
+  DbList            _records;       // records and their strings
+  vector<time_t>    _timestamps;    // DB timestamp of each record
+  vector<size_t>    _paths;         // first record of each path, then end
+  bool              _sorted;
+  struct Newer;
+  // Sort records, if needed
+  void sort();
+public:
+  DbVersions() : _sorted(true) {}
+  size_t size() const   { return _timestamps.size(); }
+  // Number of paths, whatever their records
+  size_t paths();
+  void clear();
+  // Add all records of list or journal, whatever their order
+  int  add(
+    const string& path,
+    const string& filename);
+  // Get records for prefix at given time (removed records are skipped)
+  void snapshot(
+    const char*   prefix,
+    time_t        date,
+    vector<const DbData*>& records);
 };
 
 class List : public Stream {
+  // Index of blocks, to find a prefix/path without reading the whole list
+  struct Block {
+    long long     offset;     // block start in file
+    String        prefix;     // first prefix in block
+    String        path;       // first path in block (none if prefix starts it)
+  };
   String          _line;
   // -1: error, 0: read again, 1: use current
   int             _line_status;
+  vector<Block>   _index;
+  String          _prefix;        // last prefix written
+  size_t          _block_size;    // start new block when reached (0: none)
+  size_t          _block_data;    // uncompressed data in current block
+  bool            _active_only;   // only write active records
+  String          _pending;       // path waiting for its first data
+  int             _unflushed;     // records written since last checkpoint
+  char*           _wbuffer;       // lines waiting to be written
+  size_t          _wlength;       // length of lines waiting
+  unsigned long   _prefix_crc;    // CRC32 of last prefix line read
+  unsigned long   _path_crc;      // CRC32 of last prefix and path lines read
+  // Write data line of record, with its check
+  int putData(
+    const char*   prefix,
+    const char*   path,
+    const String& data,
+    time_t        timestamp);
+  // Write line, only keeping active records if required
+  int putLine(
+    const char*   line,
+    size_t        length);
+  // Write line, starting a new block at a prefix or path if needed
+  int writeLine(
+    const char*   line,
+    size_t        length);
+  // Buffer data, writing buffer to file when full
+  int bufferWrite(
+    const char*   data,
+    size_t        length);
+  // Write buffered data to file
+  int writeBuffer();
+  // Index is written after the data, as an uncompressed trailer
+  int loadIndex();
+  int saveIndex();
   int copyUntil(
     List&         list,
     StrPath&      prefix,
@@ -43,18 +200,57 @@ public:
   List(
     const char*   dir_path,
     const char*   name = "") :
-    Stream(dir_path, name) {}
-  // Open file, for read or write (no append)
+    Stream(dir_path, name),
+    _active_only(false),
+    _unflushed(0),
+    _wbuffer(NULL),
+    _wlength(0) {}
+  ~List() { free(_wbuffer); }
+  // Default uncompressed data size of blocks
+  static const size_t block_size = 131072;
+  // Records written between automatic checkpoints
+  static const int checkpoint_records = 256;
+  // Lines are written to file in batches of up to this size
+  static const size_t write_buffer_size = 65536;
+  // Open file, for read or write (no append), with or without compression
   int open(
-    const char*   req_mode);
+    const char*   req_mode,
+    unsigned int  compression = 0,
+    size_t        block_size  = List::block_size);
   // Close file
   int close();
+  // Only write first data line of each path, and no removed paths
+  void setActiveOnly(bool active_only = true) { _active_only = active_only; }
   // Fake Loading current line from file
   ssize_t currentLine();
   // Load next line from file
   ssize_t nextLine();
-  // Skip to given prefix
+  // Skip to given prefix (uses index when available)
   bool findPrefix(const char* prefix);
+  // Read next prefix, to be copied using copyPrefix (0 when none left)
+  int nextPrefix(
+    String&       prefix);
+  // Copy all records for current prefix of given list
+  int copyPrefix(
+    List&         list);
+  // Number of indexed blocks
+  int blocks() const { return _index.size(); }
+  // Move read position to indexed block, giving the prefix in use there
+  int seekBlock(
+    int           block,
+    String&       prefix);
+  // Check whether prefix (path empty) or path line starts indexed block
+  bool startsBlock(
+    int           block,
+    const char*   prefix,
+    const char*   path) const;
+  // Decode data line, given without its leading tabs nor ending newline:
+  // tabs are replaced by null characters (-1 if corrupted). If given, crc
+  // is updated with the data fields for checking.
+  static int decodeData(
+    char*         line,
+    ListData&     data,
+    unsigned long* crc = NULL);
   // Convert one 'line' of data (only works for journal atm)
   int getEntry(
     time_t*       timestamp,
@@ -72,6 +268,8 @@ public:
     const char*   prefix,
     const char*   path,
     time_t        timestamp = -1);
+  // Write all buffered records, making them readable in case of crash
+  int checkpoint();
   // Get a list of active records for given prefix and paths
   void getList(
     const char*   prefix,
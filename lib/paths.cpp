@@ -19,7 +19,20 @@
 #include <iostream>
 #include <string>
 #include <list>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <time.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <errno.h>
 
@@ -38,14 +51,860 @@ using namespace std;
 
 using namespace hbackup;
 
+// Directory listing to be done ahead of the walk
+struct Path::Scan {
+  char*             path;
+  Directory*        dir;          // receives the list
+  int               rc;
+  int               error;        // errno if failed
+  enum { queued, running, done } state;
+  bool              dropped;      // walk does not want it anymore
+};
+
+// Walk is depth-first, so latest queued directories are needed first: they
+// are put at the front of the queue. The walk takes listings that were not
+// started yet itself, so it never waits for an idle thread.
+struct Path::Prefetch : public StatSlots {
+  pthread_mutex_t   mutex;
+  pthread_cond_t    cond;
+  deque<Scan*>      queue;
+  vector<pthread_t> threads;
+  bool              stop;
+  bool              by_inode;     // stat entries in inode order
+  int               stats;        // lstat calls allowed at once
+  int               slots;        // lstat calls that may still be issued
+  int  take(int count);
+  void give(int count);
+};
+
+int Path::Prefetch::take(int count) {
+  pthread_mutex_lock(&mutex);
+  if (count > slots) {
+    count = slots;
+  }
+  slots -= count;
+  pthread_mutex_unlock(&mutex);
+  return count;
+}
+
+void Path::Prefetch::give(int count) {
+  pthread_mutex_lock(&mutex);
+  slots += count;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+}
+
+// Listing is bound by lstat latency (NFS), not processors
+static const int max_scanners = 8;
+
+// Walk progress is recorded this often (seconds), for an interrupted walk to
+// resume there
+static const int progress_interval = 10;
+
+// Directories this large on disk (a few tens of thousands of entries) are
+// walked without keeping their entries nor records in memory
+static const long long stream_size = 1 << 20;
+
+int Path::listDirectory(
+    Prefetch*     prefetch,
+    Directory*    dir,
+    const char*   path,
+    SortedDirectory* sorted) {
+  // Take one of the client's lstat slots, the listing takes more if it has
+  // enough entries and they are free, so small directories go in parallel
+  pthread_mutex_lock(&prefetch->mutex);
+  while (prefetch->slots == 0) {
+    pthread_cond_wait(&prefetch->cond, &prefetch->mutex);
+  }
+  prefetch->slots--;
+  pthread_mutex_unlock(&prefetch->mutex);
+  int rc    = (sorted != NULL) ?
+    sorted->open(path, prefetch->stats, prefetch) :
+    dir->createList(path, true, prefetch->stats, prefetch->by_inode, prefetch);
+  int error = errno;
+  prefetch->give(1);
+  errno = error;
+  return rc;
+}
+
+void* Path::prefetchThread(void* data) {
+  Prefetch* prefetch = static_cast<Prefetch*>(data);
+  pthread_mutex_lock(&prefetch->mutex);
+  while (true) {
+    while (prefetch->queue.empty() && ! prefetch->stop) {
+      pthread_cond_wait(&prefetch->cond, &prefetch->mutex);
+    }
+    if (prefetch->stop) {
+      break;
+    }
+    Scan* scan = prefetch->queue.front();
+    prefetch->queue.pop_front();
+    scan->state = Scan::running;
+    pthread_mutex_unlock(&prefetch->mutex);
+    int rc    = listDirectory(prefetch, scan->dir, scan->path);
+    int error = errno;
+    pthread_mutex_lock(&prefetch->mutex);
+    scan->rc    = rc;
+    scan->error = error;
+    scan->state = Scan::done;
+    if (scan->dropped) {
+      free(scan->path);
+      delete scan->dir;
+      delete scan;
+    }
+    pthread_cond_broadcast(&prefetch->cond);
+  }
+  pthread_mutex_unlock(&prefetch->mutex);
+  return NULL;
+}
+
+void Path::startPrefetch() {
+  _prefetch = new Prefetch;
+  pthread_mutex_init(&_prefetch->mutex, NULL);
+  pthread_cond_init(&_prefetch->cond, NULL);
+  _prefetch->stop  = false;
+  _prefetch->stats = (_concurrency > 0) ? _concurrency : 1;
+  _prefetch->slots = _prefetch->stats;
+  _prefetch->by_inode = _locality;
+  for (int i = 0; (i < max_scanners) && (i < _concurrency - 1); i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, prefetchThread, _prefetch)) {
+      // Fewer threads, or none: the walk lists directories itself
+      break;
+    }
+    _prefetch->threads.push_back(thread);
+  }
+}
+
+void Path::stopPrefetch() {
+  pthread_mutex_lock(&_prefetch->mutex);
+  _prefetch->stop = true;
+  pthread_cond_broadcast(&_prefetch->cond);
+  pthread_mutex_unlock(&_prefetch->mutex);
+  for (vector<pthread_t>::iterator i = _prefetch->threads.begin();
+      i != _prefetch->threads.end(); i++) {
+    pthread_join(*i, NULL);
+  }
+  // Walk took or dropped all listings
+  pthread_cond_destroy(&_prefetch->cond);
+  pthread_mutex_destroy(&_prefetch->mutex);
+  delete _prefetch;
+  _prefetch = NULL;
+}
+
+Path::Scan* Path::prefetch(
+    const char*   path,
+    const Node&   node) {
+  Scan* scan    = new Scan;
+  scan->path    = Node::path(path, node.name());
+  scan->dir     = new Directory(node);
+  scan->rc      = 0;
+  scan->error   = 0;
+  scan->state   = Scan::queued;
+  scan->dropped = false;
+  return scan;
+}
+
+void Path::queue(
+    list<Scan*>&  scans) {
+  pthread_mutex_lock(&_prefetch->mutex);
+  _prefetch->queue.insert(_prefetch->queue.begin(), scans.begin(),
+    scans.end());
+  pthread_cond_broadcast(&_prefetch->cond);
+  pthread_mutex_unlock(&_prefetch->mutex);
+}
+
+int Path::take(
+    Scan*         scan,
+    Directory*    dir) {
+  pthread_mutex_lock(&_prefetch->mutex);
+  if (scan->state == Scan::queued) {
+    // Not started: do it now
+    for (deque<Scan*>::iterator i = _prefetch->queue.begin();
+        i != _prefetch->queue.end(); i++) {
+      if (*i == scan) {
+        _prefetch->queue.erase(i);
+        break;
+      }
+    }
+    pthread_mutex_unlock(&_prefetch->mutex);
+    scan->rc    = listDirectory(_prefetch, scan->dir, scan->path);
+    scan->error = errno;
+  } else {
+    while (scan->state != Scan::done) {
+      pthread_cond_wait(&_prefetch->cond, &_prefetch->mutex);
+    }
+    pthread_mutex_unlock(&_prefetch->mutex);
+  }
+  int rc = scan->rc;
+  if (rc != 0) {
+    errno = scan->error;
+  }
+  dir->nodesList().swap(scan->dir->nodesList());
+  free(scan->path);
+  delete scan->dir;
+  delete scan;
+  return rc;
+}
+
+void Path::drop(
+    Scan*         scan) {
+  pthread_mutex_lock(&_prefetch->mutex);
+  if (scan->state == Scan::running) {
+    // Thread deletes it when done
+    scan->dropped = true;
+    scan = NULL;
+  } else
+  if (scan->state == Scan::queued) {
+    for (deque<Scan*>::iterator i = _prefetch->queue.begin();
+        i != _prefetch->queue.end(); i++) {
+      if (*i == scan) {
+        _prefetch->queue.erase(i);
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&_prefetch->mutex);
+  if (scan != NULL) {
+    free(scan->path);
+    delete scan->dir;
+    delete scan;
+  }
+}
+
+// Data copy to be done ahead of the walk
+struct Path::Copy {
+  char*             path;         // directory
+  char*             name;
+  long long         size;
+  int               depth;        // deepest directories are needed first
+  long long         warm;         // data asked to be read ahead
+  char*             checksum;     // NULL if failed
+  enum { pending, queued, running, done } state;
+  bool              dropped;      // walk does not want it anymore
+};
+
+// Copies of a directory: jobs in path order, for the walk to wait for, and
+// those not submitted yet, last to submit first
+struct Path::Copies {
+  list<Copy*>       jobs;
+  vector<Copy*>     pending;
+};
+
+// Workers take jobs of the deepest directory first, in submission order
+// (disk order if required). The walk waits for them in path order, so
+// journal records are still written in order.
+struct Path::Copier {
+  pthread_mutex_t   mutex;
+  pthread_cond_t    cond;
+  deque<Copy*>      queue;
+  vector<pthread_t> threads;
+  Database*         db;
+  bool              stop;
+  int               workers;      // to name temporary files
+  int               jobs;         // jobs queued or running
+  long long         bytes;        // data of jobs queued or running
+  long long         warm;         // data of jobs read ahead, not copied yet
+};
+
+// Copying is bound by I/O latency, more workers would only compete for disk
+static const int       max_copiers   = 4;
+// Walk may not get too far ahead of the copies (temporary files)
+static const int       max_copy_jobs = 64;
+static const long long copy_budget   = 64 << 20;
+// Data of the next jobs is read ahead while copying, to be in cache when
+// their copy starts (NFS latency), within limits not to evict it before
+static const int       max_readahead    = 8;
+static const long long readahead_budget = 32 << 20;
+
+bool Path::deeper(
+    const Copy*   left,
+    const Copy*   right) {
+  return left->depth > right->depth;
+}
+
+void* Path::copyThread(void* data) {
+  Copier* copier = static_cast<Copier*>(data);
+  pthread_mutex_lock(&copier->mutex);
+  int slot = ++copier->workers;
+  while (true) {
+    while (copier->queue.empty() && ! copier->stop) {
+      pthread_cond_wait(&copier->cond, &copier->mutex);
+    }
+    if (copier->stop) {
+      break;
+    }
+    deque<Copy*>::iterator next = copier->queue.begin();
+    for (deque<Copy*>::iterator i = copier->queue.begin();
+        i != copier->queue.end(); i++) {
+      if ((*i)->depth > (*next)->depth) {
+        next = i;
+      }
+    }
+    Copy* copy = *next;
+    copier->queue.erase(next);
+    copy->state = Copy::running;
+    // Next jobs, in the order workers take them
+    vector<Copy*> coming(copier->queue.begin(), copier->queue.end());
+    stable_sort(coming.begin(), coming.end(), deeper);
+    vector<pair<char*, long long> > warm;
+    for (size_t i = 0; (i < coming.size()) && (i < size_t(max_readahead));
+        i++) {
+      if ((coming[i]->warm != 0) || (coming[i]->size == 0)) {
+        continue;
+      }
+      long long length = readahead_budget - copier->warm;
+      if (length <= 0) {
+        break;
+      }
+      if (length > coming[i]->size) {
+        length = coming[i]->size;
+      }
+      coming[i]->warm = length;
+      copier->warm   += length;
+      warm.push_back(pair<char*, long long>(
+        Node::path(coming[i]->path, coming[i]->name), length));
+    }
+    pthread_mutex_unlock(&copier->mutex);
+    for (size_t i = 0; i < warm.size(); i++) {
+      int fd = open(warm[i].first, O_RDONLY);
+      if (fd >= 0) {
+        posix_fadvise(fd, 0, warm[i].second, POSIX_FADV_WILLNEED);
+        close(fd);
+      }
+      free(warm[i].first);
+    }
+    // Unreadable files are left to the walk, which reports them in order
+    char* full_path = Node::path(copy->path, copy->name);
+    bool  readable  = (access(full_path, R_OK) == 0);
+    free(full_path);
+    char* checksum = NULL;
+    if (terminating() || ! readable
+     || copier->db->copy(copy->path, copy->name, &checksum, slot)) {
+      // Walk will try again
+      checksum = NULL;
+    }
+    pthread_mutex_lock(&copier->mutex);
+    copy->checksum = checksum;
+    copy->state    = Copy::done;
+    copier->jobs--;
+    copier->bytes -= copy->size;
+    copier->warm  -= copy->warm;
+    if (copy->dropped) {
+      freeCopy(copy);
+    }
+    pthread_cond_broadcast(&copier->cond);
+  }
+  pthread_mutex_unlock(&copier->mutex);
+  return NULL;
+}
+
+void Path::startCopier(
+    Database&     db) {
+  _copier = new Copier;
+  pthread_mutex_init(&_copier->mutex, NULL);
+  pthread_cond_init(&_copier->cond, NULL);
+  _copier->db      = &db;
+  _copier->stop    = false;
+  _copier->workers = 0;
+  _copier->jobs    = 0;
+  _copier->bytes   = 0;
+  _copier->warm    = 0;
+  for (int i = 0; i < max_copiers; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, copyThread, _copier)) {
+      break;
+    }
+    _copier->threads.push_back(thread);
+  }
+  if (_copier->threads.empty()) {
+    // The walk copies data itself
+    stopCopier();
+  }
+}
+
+void Path::stopCopier() {
+  // Already stopped if no worker could start
+  if (_copier == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&_copier->mutex);
+  _copier->stop = true;
+  pthread_cond_broadcast(&_copier->cond);
+  pthread_mutex_unlock(&_copier->mutex);
+  for (vector<pthread_t>::iterator i = _copier->threads.begin();
+      i != _copier->threads.end(); i++) {
+    pthread_join(*i, NULL);
+  }
+  // Walk took or dropped all copies
+  pthread_cond_destroy(&_copier->cond);
+  pthread_mutex_destroy(&_copier->mutex);
+  delete _copier;
+  _copier = NULL;
+}
+
+void Path::freeCopy(
+    Copy*         copy) {
+  free(copy->path);
+  free(copy->name);
+  free(copy->checksum);
+  delete copy;
+}
+
+// Physical position of start of file data, -1 if unknown
+static long long diskOffset(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  long long buffer[(sizeof(struct fiemap) + sizeof(struct fiemap_extent))
+    / sizeof(long long) + 1];
+  struct fiemap* map = reinterpret_cast<struct fiemap*>(buffer);
+  memset(buffer, 0, sizeof(buffer));
+  map->fm_length       = FIEMAP_MAX_OFFSET;
+  map->fm_extent_count = 1;
+  long long offset = -1;
+  if ((ioctl(fd, FS_IOC_FIEMAP, map) == 0) && (map->fm_mapped_extents > 0)) {
+    offset = map->fm_extents[0].fe_physical;
+  }
+  close(fd);
+  return offset;
+}
+
+void Path::prepareCopies(
+    const char*   cur_path,
+    const char*   rel_path,
+    int           depth,
+    Directory*    dir,
+    Parser*       parser,
+    const vector<const DbData*>& db_list,
+    Copies&       copies) {
+  // Same decisions as the walk, for files only
+  vector<pair<long long, size_t> > order;    // disk position, path order
+  vector<Copy*> by_path;
+  set<pair<dev_t, ino_t> > inodes;            // files with several links
+  vector<const DbData*>::const_iterator j = db_list.begin();
+  for (list<Node*>::iterator i = dir->nodesList().begin();
+      i != dir->nodesList().end(); i++) {
+    if (((*i)->type() != 'f')
+     || ((parser != NULL) && parser->ignore(*(*i)))
+     || (! _filters.empty() && _filters.match(rel_path, *(*i)))) {
+      continue;
+    }
+    int cmp = -1;
+    while ((j != db_list.end())
+        && ((cmp = Node::pathCompare((*j)->name(), (*i)->name())) < 0)) {
+      j++;
+    }
+    if ((j != db_list.end()) && (cmp == 0)
+     && ((! (**j != **i))
+      || (((*j)->type() == 'f') && ((*i)->size() == (*j)->size())
+       && ((*i)->mtime() == (*j)->mtime())))) {
+      // Data already there, or retried by the walk
+      continue;
+    }
+    if (((*i)->links() > 1)
+     && ((hardLink(*i) != NULL)
+      || ! inodes.insert(pair<dev_t, ino_t>((*i)->device(),
+          (*i)->inode())).second)) {
+      // Data read for another link
+      continue;
+    }
+    long long offset = 0;
+    if (_locality) {
+      char* path = Node::path(cur_path, (*i)->name());
+      offset = diskOffset(path);
+      free(path);
+    }
+    order.push_back(pair<long long, size_t>(offset, order.size()));
+    Copy* copy     = new Copy;
+    copy->path     = strdup(cur_path);
+    copy->name     = strdup((*i)->name());
+    copy->size     = (*i)->size();
+    copy->depth    = depth;
+    copy->warm     = 0;
+    copy->checksum = NULL;
+    copy->state    = Copy::pending;
+    copy->dropped  = false;
+    copies.jobs.push_back(copy);
+    by_path.push_back(copy);
+  }
+  // Disk order, files which position is unknown first, or path order
+  std::sort(order.begin(), order.end());
+  for (size_t n = order.size(); n > 0; n--) {
+    copies.pending.push_back(by_path[order[n - 1].second]);
+  }
+}
+
+void Path::submit(
+    Copies&       copies) {
+  while (! copies.pending.empty()) {
+    Copy* copy = copies.pending.back();
+    // Let one job in whatever its size
+    if ((_copier->jobs >= max_copy_jobs)
+     || ((_copier->bytes > 0)
+      && (_copier->bytes + copy->size > copy_budget))) {
+      break;
+    }
+    copy->state = Copy::queued;
+    _copier->queue.push_back(copy);
+    _copier->jobs++;
+    _copier->bytes += copy->size;
+    copies.pending.pop_back();
+    pthread_cond_broadcast(&_copier->cond);
+  }
+}
+
+void Path::startCopies(
+    Copies&       copies) {
+  pthread_mutex_lock(&_copier->mutex);
+  submit(copies);
+  pthread_mutex_unlock(&_copier->mutex);
+}
+
+void Path::drop(
+    Copies&       copies,
+    Copy*         copy) {
+  if (copy->state == Copy::pending) {
+    for (vector<Copy*>::iterator i = copies.pending.begin();
+        i != copies.pending.end(); i++) {
+      if (*i == copy) {
+        copies.pending.erase(i);
+        break;
+      }
+    }
+  } else
+  if (copy->state == Copy::queued) {
+    for (deque<Copy*>::iterator i = _copier->queue.begin();
+        i != _copier->queue.end(); i++) {
+      if (*i == copy) {
+        _copier->queue.erase(i);
+        break;
+      }
+    }
+    _copier->jobs--;
+    _copier->bytes -= copy->size;
+    _copier->warm  -= copy->warm;
+  } else
+  if (copy->state == Copy::running) {
+    // Worker frees it when done
+    copy->dropped = true;
+    return;
+  }
+  freeCopy(copy);
+}
+
+const char* Path::copied(
+    Copies&       copies,
+    const Node*   node) {
+  if (_copier == NULL) {
+    return NULL;
+  }
+  pthread_mutex_lock(&_copier->mutex);
+  // Copies are in path order, those of files skipped by the walk are dropped
+  Copy* copy = NULL;
+  while (! copies.jobs.empty()) {
+    int cmp = Node::pathCompare(copies.jobs.front()->name, node->name());
+    if (cmp > 0) {
+      break;
+    }
+    if (cmp == 0) {
+      copy = copies.jobs.front();
+      break;
+    }
+    drop(copies, copies.jobs.front());
+    copies.jobs.pop_front();
+  }
+  const char* checksum = NULL;
+  if (copy != NULL) {
+    // Keep workers busy while waiting, submitting our job in its turn
+    submit(copies);
+    while (copy->state != Copy::done) {
+      pthread_cond_wait(&_copier->cond, &_copier->mutex);
+      submit(copies);
+    }
+    // Kept until next call or end of directory
+    checksum = copy->checksum;
+  }
+  pthread_mutex_unlock(&_copier->mutex);
+  return checksum;
+}
+
+void Path::endCopies(
+    Copies&       copies) {
+  if (_copier == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&_copier->mutex);
+  while (! copies.jobs.empty()) {
+    drop(copies, copies.jobs.front());
+    copies.jobs.pop_front();
+  }
+  pthread_mutex_unlock(&_copier->mutex);
+}
+
+// First link met of a file with several
+struct Path::HardLink {
+  long long         size;
+  time_t            mtime;
+  string            path;         // in database
+  string            checksum;
+};
+
+// Files with several hard links met during the run
+struct Path::HardLinks {
+  map<pair<dev_t, ino_t>, HardLink> files;
+};
+
+const Path::HardLink* Path::hardLink(
+    const Node*   node) const {
+  if ((node->type() != 'f') || (node->links() < 2)) {
+    return NULL;
+  }
+  map<pair<dev_t, ino_t>, HardLink>::const_iterator i =
+    _hard_links->files.find(pair<dev_t, ino_t>(node->device(), node->inode()));
+  if ((i == _hard_links->files.end())
+   || (i->second.size != node->size()) || (i->second.mtime != node->mtime())) {
+    // Not met, or changed since
+    return NULL;
+  }
+  return &i->second;
+}
+
+void Path::addHardLink(
+    const char*   rel_path,
+    const Node*   node,
+    const char*   checksum) {
+  if ((node->type() != 'f') || (node->links() < 2) || (checksum[0] == '\0')) {
+    return;
+  }
+  HardLink& link = _hard_links->files[pair<dev_t, ino_t>(node->device(),
+    node->inode())];
+  link.size     = node->size();
+  link.mtime    = node->mtime();
+  link.path     = _path.c_str();
+  if (rel_path[0] != '\0') {
+    link.path  += "/";
+    link.path  += rel_path;
+  }
+  link.path    += "/";
+  link.path    += node->name();
+  link.checksum = checksum;
+}
+
+void Path::addFile(
+    Database&     db,
+    const char*   prefix,
+    const char*   rel_path,
+    const char*   cur_path,
+    const Node*   node,
+    const char*   checksum,
+    Copies&       copies) {
+  const HardLink* link = hardLink(node);
+  if (link != NULL) {
+    // Data already read for an earlier link
+    if ((checksum == NULL) || (checksum[0] == '\0')) {
+      checksum = link->checksum.c_str();
+    }
+    db.add(prefix, _path.c_str(), rel_path, cur_path, node, checksum,
+      link->path.c_str());
+    return;
+  }
+  char* copy = NULL;
+  if ((checksum == NULL) && (node->type() == 'f')) {
+    checksum = copied(copies, node);
+    // Copy it now to know the checksum for other links
+    if ((checksum == NULL) && (node->links() > 1)
+     && ! db.copy(cur_path, node->name(), &copy)) {
+      checksum = copy;
+    }
+  }
+  db.add(prefix, _path.c_str(), rel_path, cur_path, node, checksum);
+  if (checksum != NULL) {
+    addHardLink(rel_path, node, checksum);
+  }
+  free(copy);
+}
+
+// Directories are told by their relative path, the root being ""
+struct Path::Watches {
+  int               fd;
+  map<int, string>  dirs;         // watch descriptor -> directory
+  set<string>       dirty;        // changed since last walk
+  set<string>       walk;         // changed, walked now
+  bool              lost;         // events lost, walk everything next time
+  bool              all;          // walk everything now
+};
+
+// Entries added, removed, renamed or changed, in watched directory
+static const uint32_t watch_mask = IN_CREATE | IN_DELETE | IN_MODIFY
+  | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR
+  | IN_DONT_FOLLOW;
+
+void Path::startWatches() {
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0) {
+    cerr << strerror(errno) << ": cannot watch " << _path.c_str()
+      << ", walking it all every time" << endl;
+    return;
+  }
+  _watches       = new Watches;
+  _watches->fd   = fd;
+  _watches->lost = false;
+  // First walk adds the watches
+  _watches->all  = true;
+}
+
+void Path::watch(
+    const char*   cur_path,
+    const char*   rel_path) {
+  int wd = inotify_add_watch(_watches->fd, cur_path, watch_mask);
+  if (wd < 0) {
+    // Most likely out of watches (fs.inotify.max_user_watches)
+    if (! _watches->lost) {
+      cerr << strerror(errno) << ": cannot watch " << cur_path
+        << ", walking it all next time" << endl;
+    }
+    _watches->lost = true;
+  } else {
+    // Same descriptor for same directory, which may have been moved
+    _watches->dirs[wd] = rel_path;
+  }
+}
+
+bool Path::readWatches() {
+  // Events are aligned on their header
+  union {
+    struct inotify_event  event;
+    char                  bytes[65536];
+  } buffer;
+  ssize_t length;
+  while ((length = read(_watches->fd, &buffer, sizeof(buffer))) > 0) {
+    for (ssize_t offset = 0; offset < length; ) {
+      const struct inotify_event* event =
+        (const struct inotify_event*) &buffer.bytes[offset];
+      offset += sizeof(struct inotify_event) + event->len;
+      if (event->mask & IN_Q_OVERFLOW) {
+        _watches->lost = true;
+        continue;
+      }
+      map<int, string>::iterator i = _watches->dirs.find(event->wd);
+      if (i == _watches->dirs.end()) {
+        continue;
+      }
+      if (event->mask & IN_IGNORED) {
+        // Directory removed, its parent knows
+        _watches->dirs.erase(i);
+      } else {
+        _watches->dirty.insert(i->second);
+      }
+    }
+  }
+  if ((length < 0) && (errno != EAGAIN)) {
+    cerr << strerror(errno) << ": cannot read changes of " << _path.c_str()
+      << endl;
+    _watches->lost = true;
+  }
+  _watches->all  = _watches->lost;
+  _watches->lost = false;
+  _watches->walk.clear();
+  _watches->walk.swap(_watches->dirty);
+  return _watches->all || ! _watches->walk.empty();
+}
+
+bool Path::stopping() {
+  if (! _stopped && (_deadline != 0) && (time(NULL) >= _deadline)) {
+    _stopped = true;
+  }
+  return _stopped || terminating();
+}
+
+bool Path::resumed(
+    const char*   rel_path,
+    const char*   name) const {
+  if (_resume.empty()) {
+    return false;
+  }
+  string path = rel_path;
+  if (! path.empty()) {
+    path += "/";
+  }
+  path += name;
+  int cmp = Node::pathCompare(path.c_str(), _resume.c_str());
+  if (cmp > 0) {
+    return false;
+  }
+  // Parents of last directory done are not done
+  path += "/";
+  return (cmp == 0) || (_resume.compare(0, path.size(), path) != 0);
+}
+
+bool Path::changed(
+    const char*   rel_path,
+    const char*   name) const {
+  if ((_watches == NULL) || _watches->all) {
+    return true;
+  }
+  string path = rel_path;
+  if (! path.empty()) {
+    path += "/";
+  }
+  path += name;
+  set<string>::const_iterator i = _watches->walk.find(path);
+  if (i != _watches->walk.end()) {
+    return true;
+  }
+  // Sub-directories follow "<path>/" in the set
+  path += "/";
+  i = _watches->walk.lower_bound(path);
+  return (i != _watches->walk.end())
+    && (i->compare(0, path.size(), path) == 0);
+}
+
+// Database records of a directory, from list or cursor
+struct DirRecords {
+  vector<const DbData*> list;
+  size_t                next;
+  Database::Cursor      cursor;
+  bool                  streamed;
+};
+
+static const DbData* nextRecord(Database& db, DirRecords& records) {
+  if (records.streamed) {
+    return db.next(records.cursor);
+  }
+  if (records.next < records.list.size()) {
+    return records.list[records.next++];
+  }
+  return NULL;
+}
+
+// Entries of a directory, from list or sorted runs
+static Node* nextNode(Directory* dir, SortedDirectory* sorted) {
+  if (sorted != NULL) {
+    return sorted->next();
+  }
+  if (dir->nodesList().empty()) {
+    return NULL;
+  }
+  Node* node = dir->nodesList().front();
+  dir->nodesList().pop_front();
+  return node;
+}
+
 int Path::recurse(
     Database&   db,
     const char* prefix,
     const char* cur_path,
     Directory*  dir,
-    Parser*     parser) {
-  if (terminating()) {
-    errno = EINTR;
+    Parser*     parser,
+    Scan*       scan,
+    bool        huge) {
+  if (stopping()) {
+    if (scan != NULL) {
+      drop(scan);
+    }
+    errno = terminating() ? EINTR : ETIMEDOUT;
     return -1;
   }
 
@@ -68,91 +927,146 @@ int Path::recurse(
       parser = _parsers.isControlled(cur_path);
     }
   }
-  if (dir->isValid() && ! dir->createList(cur_path)) {
-    list<Node*> db_list;
-    // Get database info for this directory
-    db.getList(prefix, _path.c_str(), rel_path, db_list);
-
-    list<Node*>::iterator i = dir->nodesList().begin();
-    list<Node*>::iterator j = db_list.begin();
-    while (i != dir->nodesList().end()) {
-      if (! terminating()) {
-        // Ignore inaccessible files
-        if ((*i)->type() == '?') {
-          i = dir->nodesList().erase(i);
-          continue;
-        }
+  // Watch before listing, not to miss changes (listed ahead: watched then)
+  if ((_watches != NULL) && (scan == NULL) && dir->isValid()) {
+    watch(cur_path, rel_path);
+  }
+  // Get contents, maybe listed ahead, sorted on disk if huge
+  int listed = -1;
+  SortedDirectory* sorted = NULL;
+  if (scan != NULL) {
+    listed = take(scan, dir);
+  } else
+  if (dir->isValid()) {
+    if (huge) {
+      sorted = new SortedDirectory(db.path().c_str());
+    }
+    listed = (_prefetch != NULL) ?
+      listDirectory(_prefetch, dir, cur_path, sorted) :
+      (sorted != NULL) ? sorted->open(cur_path) :
+      dir->createList(cur_path, true, 1, _locality);
+  }
+  if (dir->isValid() && (listed == 0)) {
+    DirRecords records;
+    records.next     = 0;
+    records.streamed = (sorted != NULL);
+    // Get database info for this directory (all files would look new if not)
+    if (records.streamed ?
+        db.getCursor(prefix, _path.c_str(), rel_path, records.cursor) :
+        db.getList(prefix, _path.c_str(), rel_path, records.list)) {
+      cerr << "Cannot get list from database for " << prefix << endl;
+      delete sorted;
+      return -1;
+    }
 
-        // Let the parser analyse the file data to know whether to back it up
-        if ((parser != NULL) && (parser->ignore(*(*i)))) {
-          i = dir->nodesList().erase(i);
-          continue;
+    // Have sub-directories listed while we deal with this one
+    list<Scan*> scans;
+    if ((_prefetch != NULL) && (sorted == NULL)) {
+      for (list<Node*>::iterator k = dir->nodesList().begin();
+          k != dir->nodesList().end(); k++) {
+        if (((*k)->type() == 'd') && ((*k)->size() < stream_size)
+         && (_filters.empty() || ! _filters.match(rel_path, *(*k)))
+         && changed(rel_path, (*k)->name())
+         && ! resumed(rel_path, (*k)->name())) {
+          if (_watches != NULL) {
+            char* dir_path = Node::path(cur_path, (*k)->name());
+            char* dir_rel  = Node::path(rel_path, (*k)->name());
+            watch(dir_path, (rel_path[0] != '\0') ? dir_rel : (*k)->name());
+            free(dir_rel);
+            free(dir_path);
+          }
+          scans.push_back(prefetch(cur_path, *(*k)));
         }
+      }
+      queue(scans);
+    }
 
-        // Now pass it through the filters
-        if (! _filters.empty() && _filters.match(rel_path, *(*i))) {
-          i = dir->nodesList().erase(i);
-          continue;
+    // Have data of new and modified files copied while we walk
+    Copies copies;
+    if ((_copier != NULL) && (sorted == NULL)) {
+      int depth = (rel_path[0] != '\0') ? 1 : 0;
+      for (const char* c = rel_path; *c != '\0'; c++) {
+        if (*c == '/') {
+          depth++;
         }
+      }
+      prepareCopies(cur_path, rel_path, depth, dir, parser, records.list,
+        copies);
+      startCopies(copies);
+    }
 
+    Node*         node = nextNode(dir, sorted);
+    const DbData* rec  = nextRecord(db, records);
+    while (node != NULL) {
+      if (! stopping()
+          // Ignore inaccessible files
+       && (node->type() != '?')
+          // Let the parser analyse the file data to know whether to back it up
+       && ((parser == NULL) || ! parser->ignore(*node))
+          // Now pass it through the filters
+       && (_filters.empty() || ! _filters.match(rel_path, *node))) {
         // Count the nodes considered, for info
         _nodes++;
 
         // For link, find out linked path
-        if ((*i)->type() == 'l') {
-          Link *l = new Link(*(*i), cur_path);
-          delete *i;
-          *i = l;
+        if (node->type() == 'l') {
+          Link *l = new Link(*node, cur_path);
+          delete node;
+          node = l;
         }
 
         // Also deal with directory, as some fields should not be considered
-        if ((*i)->type() == 'd') {
-          Directory *d = new Directory(*(*i));
-          delete *i;
-          *i = d;
+        bool huge_dir = false;
+        if (node->type() == 'd') {
+          huge_dir = (node->size() >= stream_size);
+          Directory *d = new Directory(*node);
+          delete node;
+          node = d;
         }
 
         // Synchronize with DB records
-        int cmp = -1;
-        while ((j != db_list.end())
-            && ((cmp = Node::pathCompare((*j)->name(), (*i)->name())) < 0)) {
-          if (! terminating()) {
+        int  cmp       = -1;
+        bool known_dir = false;
+        while ((rec != NULL)
+            && ((cmp = Node::pathCompare(rec->name(), node->name())) < 0)) {
+          if (! stopping()) {
             if (verbosity() > 2) {
               cout << " --> R ";
               if (rel_path[0] != '\0') {
                 cout << rel_path << "/";
               }
-              cout << (*j)->name() << endl;
+              cout << rec->name() << endl;
             }
-            recurse_remove(db, prefix, _path, rel_path, *j);
+            recurse_remove(db, prefix, _path, rel_path, rec);
           }
-          delete *j;
-          j = db_list.erase(j);
+          rec = nextRecord(db, records);
         }
 
         // Deal with data
-        if ((j == db_list.end()) || (cmp > 0)) {
+        if ((rec == NULL) || (cmp > 0)) {
           // Not found in DB => new
           if (verbosity() > 2) {
             cout << " --> A ";
             if (rel_path[0] != '\0') {
               cout << rel_path << "/";
             }
-            cout << (*i)->name() << endl;
+            cout << node->name() << endl;
           }
-          db.add(prefix, _path.c_str(), rel_path, cur_path, *i);
+          addFile(db, prefix, rel_path, cur_path, node, NULL, copies);
         } else {
           // Same file name found in DB
-          if (**i != **j) {
+          known_dir = (rec->type() == 'd');
+          char buffer[DbData::checksum_size];
+          if (*rec != *node) {
             const char* checksum = NULL;
             // Metadata differ
-            if (((*i)->type() == 'f')
-            && ((*j)->type() == 'f')
-            && ((*i)->size() == (*j)->size())
-            && ((*i)->mtime() == (*j)->mtime())) {
+            if ((node->type() == 'f')
+            && (rec->type() == 'f')
+            && (node->size() == rec->size())
+            && (node->mtime() == rec->mtime())) {
               // If the file data is there, just add new metadata
               // If the checksum is missing, this shall retry too
-              checksum = ((File*)(*j))->checksum();
+              checksum = rec->checksum(buffer);
               if (verbosity() > 2) {
                 cout << " --> ~ ";
               }
@@ -166,77 +1080,112 @@ int Path::recurse(
               if (rel_path[0] != '\0') {
                 cout << rel_path << "/";
               }
-              cout << (*i)->name() << endl;
+              cout << node->name() << endl;
             }
-            db.add(prefix, _path.c_str(), rel_path, cur_path, *i, checksum);
+            addFile(db, prefix, rel_path, cur_path, node, checksum, copies);
           } else {
-            // i and j have same metadata, hence same type...
+            // node and rec have same metadata, hence same type...
             // Compare linked data
-            if (((*i)->type() == 'l')
-            && (strcmp(((Link*)(*i))->link(), ((Link*)(*j))->link()) != 0)) {
+            if ((node->type() == 'l')
+            && (strcmp(((Link*)node)->link(), rec->link()) != 0)) {
               if (verbosity() > 2) {
                 cout << " --> L ";
                 if (rel_path[0] != '\0') {
                   cout << rel_path << "/";
                 }
-                cout << (*i)->name() << endl;
+                cout << node->name() << endl;
               }
-              db.add(prefix, _path.c_str(), rel_path, cur_path, *i);
+              db.add(prefix, _path.c_str(), rel_path, cur_path, node);
             } else
             // Check that file data is present
-            if (((*i)->type() == 'f')
-             && (((File*)(*j))->checksum()[0] == '\0')) {
+            if ((node->type() == 'f')
+             && (rec->checksum(buffer)[0] == '\0')) {
               // Checksum missing: retry
               if (verbosity() > 2) {
                 cout << " --> ! ";
                 if (rel_path[0] != '\0') {
                   cout << rel_path << "/";
                 }
-                cout << (*i)->name() << endl;
+                cout << node->name() << endl;
               }
-              const char* checksum = ((File*)(*j))->checksum();
-              db.add(prefix, _path.c_str(), rel_path, cur_path, *i, checksum);
-            } else if ((*i)->type() == 'd') {
+              const char* checksum = rec->checksum(buffer);
+              addFile(db, prefix, rel_path, cur_path, node, checksum, copies);
+            } else if (node->type() == 'd') {
               if (verbosity() > 3) {
                 cout << " --> D ";
                 if (rel_path[0] != '\0') {
                   cout << rel_path << "/";
                 }
-                cout << (*i)->name() << endl;
+                cout << node->name() << endl;
               }
+            } else if (node->type() == 'f') {
+              // Later hard links of it can use its data
+              addHardLink(rel_path, node, rec->checksum(buffer));
             }
           }
-          delete *j;
-          j = db_list.erase(j);
+          rec = nextRecord(db, records);
         }
 
-        // For directory, recurse into it
-        if ((*i)->type() == 'd') {
-          char* dir_path = Node::path(cur_path, (*i)->name());
-          recurse(db, prefix, dir_path, (Directory*) *i, parser);
+        // For directory, recurse into it (if new or changed when watching)
+        if ((node->type() == 'd')
+         && (! known_dir || (changed(rel_path, node->name())
+                          && ! resumed(rel_path, node->name())))) {
+          // Its listing, dropping those of directories skipped since
+          Scan* sub = NULL;
+          list<Scan*>::iterator k = scans.begin();
+          while ((k != scans.end())
+              && (strcmp((*k)->dir->name(), node->name()) != 0)) {
+            k++;
+          }
+          if (k != scans.end()) {
+            while (scans.front() != *k) {
+              drop(scans.front());
+              scans.pop_front();
+            }
+            sub = *k;
+            scans.pop_front();
+          }
+          char* dir_path = Node::path(cur_path, node->name());
+          recurse(db, prefix, dir_path, (Directory*) node, parser, sub,
+            huge_dir);
           free(dir_path);
         }
       }
-      delete *i;
-      i = dir->nodesList().erase(i);
+      delete node;
+      node = nextNode(dir, sorted);
     }
 
     // Deal with removed records
-    while (j != db_list.end()) {
-      if (! terminating()) {
+    while (rec != NULL) {
+      if (! stopping()) {
         if (verbosity() > 2) {
           cout << " --> R ";
           if (rel_path[0] != '\0') {
             cout << rel_path << "/";
           }
-          cout << (*j)->name() << endl;
+          cout << rec->name() << endl;
         }
-        recurse_remove(db, prefix, _path, rel_path, *j);
+        recurse_remove(db, prefix, _path, rel_path, rec);
       }
-      delete *j;
-      j = db_list.erase(j);
+      rec = nextRecord(db, records);
+    }
+    // Interrupted
+    while (! scans.empty()) {
+      drop(scans.front());
+      scans.pop_front();
+    }
+    endCopies(copies);
+    delete sorted;
+    // Directory done: a crash will not need to redo it
+    db.checkpoint();
+    // Nor will a restarted run need to walk it again
+    if ((_watches == NULL) && ! stopping()
+     && (time(NULL) - _progress_time >= progress_interval)) {
+      db.setProgress(prefix, _path.c_str(), rel_path);
+      _progress_time = time(NULL);
     }
   } else {
+    delete sorted;
     cerr << strerror(errno) << ": " << rel_path << endl;
   }
   return 0;
@@ -247,26 +1196,32 @@ void Path::recurse_remove(
     const char*   prefix,
     const StrPath base_path,
     const char*   rel_path,
-    const Node*   node) {
-  db.remove(prefix, base_path.c_str(), rel_path, node);
+    const DbData* node) {
+  db.remove(prefix, base_path.c_str(), rel_path, node->name());
   // Recurse into directories
   if (node->type() == 'd') {
-    list<Node*> db_list;
+    vector<const DbData*> db_list;
     char* dir_path = Node::path(rel_path, node->name());
 
     // Get database info for this directory
     db.getList(prefix, base_path.c_str(), dir_path, db_list);
-    list<Node*>::iterator j = db_list.begin();
-    while (j != db_list.end()) {
+    for (vector<const DbData*>::iterator j = db_list.begin();
+        j != db_list.end(); j++) {
       recurse_remove(db, prefix, base_path.c_str(), dir_path, *j);
-      delete *j;
-      j = db_list.erase(j);
     }
     free(dir_path);
   }
 }
 
 Path::Path(const char* path) {
+  _prefetch           = NULL;
+  _copier             = NULL;
+  _hard_links         = new HardLinks;
+  _watches            = NULL;
+  _deadline           = 0;
+  _stopped            = false;
+  _locality           = false;
+  _concurrency        = default_concurrency;
   _dir                = NULL;
   _expiration         = 0;
   _backup_path_length = 0;
@@ -281,6 +1236,15 @@ Path::Path(const char* path) {
   _path.noEndingSlash();
 }
 
+Path::~Path() {
+  delete _dir;
+  delete _hard_links;
+  if (_watches != NULL) {
+    close(_watches->fd);
+    delete _watches;
+  }
+}
+
 int Path::addFilter(
     const string& type,
     const string& value,
@@ -407,15 +1371,62 @@ int Path::addParser(
 int Path::parse(
     Database&   db,
     const char* prefix,
-    const char* backup_path) {
+    const char* backup_path,
+    bool        watch) {
   int rc = 0;
   _backup_path_length = strlen(backup_path);
-  _nodes = 0;
+  _nodes   = 0;
+  _stopped = false;
+  if (_watches != NULL) {
+    if (! readWatches()) {
+      // Nothing changed
+      return 0;
+    }
+    if (verbosity() > 1) {
+      if (_watches->all) {
+        cout << " -> Walking all directories" << endl;
+      } else {
+        cout << " -> Walking " << _watches->walk.size()
+          << " changed directories" << endl;
+      }
+    }
+  } else
+  if (watch) {
+    startWatches();
+  } else
+  // Carry on from where an interrupted run got
+  if ((db.getProgress(prefix, _path.c_str(), _resume) > 0)
+   && ! _resume.empty() && (verbosity() > 1)) {
+    cout << " -> Resuming walk after " << _resume << endl;
+  }
+  _progress_time = time(NULL);
+  delete _dir;
   _dir = new Directory(backup_path);
+  startPrefetch();
+  startCopier(db);
   if (recurse(db, prefix, backup_path, _dir, NULL)) {
     delete _dir;
     _dir = NULL;
     rc = -1;
   }
+  stopCopier();
+  stopPrefetch();
+  _hard_links->files.clear();
+  _resume.clear();
+  if ((_watches == NULL) && (rc == 0) && ! stopping()) {
+    // All done
+    db.setProgress(prefix, _path.c_str(), "");
+  }
+  if (_watches != NULL) {
+    _watches->walk.clear();
+    // Changes may have been missed
+    if ((rc != 0) || stopping()) {
+      _watches->lost = true;
+    }
+  }
+  if (_stopped && ! terminating()) {
+    errno = ETIMEDOUT;
+    rc    = -1;
+  }
   return rc;
 }
@@ -22,35 +22,160 @@
 namespace hbackup {
 
 class Path {
+  // Directories are listed ahead of the walk by a pool of threads
+  struct        Prefetch;
+  struct        Scan;
+  struct        Copy;
+  // File data is copied ahead of the walk by another pool of threads
+  struct        Copier;
+  struct        Copies;
+  // Files with several hard links are only read once per run
+  struct        HardLink;
+  struct        HardLinks;
+  // Changed directories are told by the kernel when watching (inotify)
+  struct        Watches;
+  Prefetch*     _prefetch;
+  Copier*       _copier;
+  HardLinks*    _hard_links;
+  Watches*      _watches;
   StrPath       _path;
   int           _backup_path_length;
   Directory*    _dir;
   Parsers       _parsers;
   Filters       _filters;
   int           _expiration;
+  int           _concurrency;   // lstat calls issued at once
+  bool          _locality;      // follow disk order
   int           _nodes;
+  string        _resume;        // last directory done by interrupted walk
+  time_t        _progress_time; // walk progress last recorded
+  time_t        _deadline;      // walk stops then (0: never)
+  bool          _stopped;       // walk stopped at deadline
+  // Whether walk must stop (deadline or termination)
+  bool stopping();
   int recurse(
     Database&     db,
     const char*   prefix,
     const char*   path,
     Directory*    dir,
-    Parser*       parser);
+    Parser*       parser,
+    Scan*         scan = NULL,
+    bool          huge = false);
+  // Start/stop listing threads
+  void startPrefetch();
+  void stopPrefetch();
+  // Prepare listing of directory, to be queued then taken or dropped by walk
+  Scan* prefetch(
+    const char*   path,
+    const Node&   node);
+  void queue(
+    list<Scan*>&  scans);
+  // Get list prepared for directory (listing it now if not started yet)
+  int  take(
+    Scan*         scan,
+    Directory*    dir);
+  void drop(
+    Scan*         scan);
+  static void* prefetchThread(
+    void*         data);
+  // Start/stop copying threads
+  void startCopier(
+    Database&     db);
+  void stopCopier();
+  static void* copyThread(
+    void*         data);
+  static void freeCopy(
+    Copy*         copy);
+  // Order in which workers take copies
+  static bool deeper(
+    const Copy*   left,
+    const Copy*   right);
+  // List copies of directory's new and modified files, disk order if required
+  void prepareCopies(
+    const char*   cur_path,
+    const char*   rel_path,
+    int           depth,
+    Directory*    dir,
+    Parser*       parser,
+    const vector<const DbData*>& db_list,
+    Copies&       copies);
+  // Queue copies as far as limits allow (mutex held)
+  void submit(
+    Copies&       copies);
+  void startCopies(
+    Copies&       copies);
+  // Forget copy (mutex held)
+  void drop(
+    Copies&       copies,
+    Copy*         copy);
+  // Wait for data of node to be copied, get its checksum (NULL if failed)
+  const char* copied(
+    Copies&       copies,
+    const Node*   node);
+  void endCopies(
+    Copies&       copies);
+  // List directory, with as many lstat calls at once as allowed, into sorted
+  // runs if given
+  static int listDirectory(
+    Prefetch*     prefetch,
+    Directory*    dir,
+    const char*   path,
+    SortedDirectory* sorted = NULL);
+  // Earlier link met of file, if any
+  const HardLink* hardLink(
+    const Node*   node) const;
+  // Remember file's data for its other links
+  void addHardLink(
+    const char*   rel_path,
+    const Node*   node,
+    const char*   checksum);
+  // Add node, with given checksum, that of an earlier link, or else of data
+  // copied ahead or now
+  void addFile(
+    Database&     db,
+    const char*   prefix,
+    const char*   rel_path,
+    const char*   cur_path,
+    const Node*   node,
+    const char*   checksum,
+    Copies&       copies);
+  // Start watching, next walks only go through changed directories
+  void startWatches();
+  // Watch directory (again if moved), walk everything when this fails
+  void watch(
+    const char*   cur_path,
+    const char*   rel_path);
+  // Get changes since last walk, false if nothing to walk
+  bool readWatches();
+  // Whether sub-directory changed or leads to a changed directory
+  bool changed(
+    const char*   rel_path,
+    const char*   name) const;
+  // Whether sub-directory was walked by interrupted run
+  bool resumed(
+    const char*   rel_path,
+    const char*   name) const;
   void recurse_remove(
     Database&     db,
     const char*   prefix,
     const StrPath base_path,
     const char*   rel_path,
-    const Node*   node);
+    const DbData* node);
 public:
   Path(const char* path);
-  ~Path() {
-    delete _dir;
-  }
+  ~Path();
   const char* path() const     { return _path.c_str(); }
   const Directory* dir() const { return _dir;          }
   int expiration() const       { return _expiration;   }
   int nodes() const            { return _nodes;        }
   void setExpiration(int expiration) { _expiration = expiration; }
+  // Limit concurrent metadata requests to file server (1: one at a time)
+  void setConcurrency(int concurrency) { _concurrency = concurrency; }
+  static const int default_concurrency = 8;
+  // Stat entries in inode order, copy data in disk order (for hard disks)
+  void setLocality(bool locality = true) { _locality = locality; }
+  // Stop walking at given time, next parse resuming there (0: never)
+  void setDeadline(time_t deadline) { _deadline = deadline; }
   // Set append to true to add as condition to last added filter
   int addFilter(
     const string& type,
@@ -60,10 +185,13 @@ public:
     const string& type,
     const string& string);
   // Need prefix to tell database
+  // Set watch to keep watching the tree for the next calls (local paths)
+  // Fails with errno set to ETIMEDOUT if deadline was reached
   int parse(
     Database&   db,
     const char* prefix,
-    const char* backup_path);
+    const char* backup_path,
+    bool        watch = false);
   // Information
   void showParsers() {
     _parsers.list();
@@ -18,6 +18,7 @@
 
 #include <iostream>
 #include <list>
+#include <vector>
 #include <errno.h>
 
 using namespace std;
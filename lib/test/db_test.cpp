@@ -19,6 +19,7 @@
 #include <iostream>
 #include <string>
 #include <list>
+#include <vector>
 #include <sys/stat.h>
 #include <errno.h>
 
@@ -209,6 +210,119 @@ int main(void) {
   if (! db.open()) {
     db.close();
   }
+  system("rm -f test_db/lock");
+
+  cout << endl << "Test: partitions" << endl;
+  Directory dir(Node("test1/testdir"));
+  if (! db.open()) {
+    db.add("file://client2", "/home/user", "", "test1", &dir);
+    db.add("file://client1", "/home/user", "", "test1", &dir);
+    db.close();
+  }
+  system("cat test_db/lists/index");
+  if (! db.open()) {
+    // Only loads the list for this client
+    vector<const DbData*> nodes;
+    db.getList("file://client2", "/home/user", "", nodes);
+    cout << "Got " << nodes.size() << " element(s)" << endl;
+    for (DbList::iterator i = ((DbList*)db.active())->begin();
+        i != ((DbList*)db.active())->end(); i++) {
+      // Owner depends on who runs the test
+      cout << i->prefix() << "\t" << i->path() << "\t" << i->type() << "\t"
+        << oct << i->mode() << dec << endl;
+    }
+    db.close();
+  }
+
+  cout << endl << "Test: directory list" << endl;
+  File file("test1/testfile");
+  if (! db.open()) {
+    db.add("file://client3", "/home/user", "", "test1", &dir);
+    db.add("file://client3", "/home/user", "testdir", "test1", &dir);
+    db.add("file://client3", "/home/user", "testdir/testdir", "test1", &dir);
+    db.add("file://client3", "/home/user", "testdir", "test1", &file,
+      "d41d8cd98f00b204e9800998ecf8427e-0");
+    db.add("file://client3", "/home/user", "", "test1", &file,
+      "d41d8cd98f00b204e9800998ecf8427e-0");
+    db.close();
+  }
+  if (! db.open()) {
+    const char* dirs[] = { "", "testdir", "testdir/testdir", "testfile" };
+    for (int i = 0; i < 4; i++) {
+      vector<const DbData*> nodes;
+      db.getList("file://client3", "/home/user", dirs[i], nodes);
+      cout << "'" << dirs[i] << "': " << nodes.size() << " element(s)" << endl;
+      for (vector<const DbData*>::iterator j = nodes.begin(); j != nodes.end();
+          j++) {
+        cout << " " << (*j)->type() << " " << (*j)->name() << endl;
+      }
+    }
+    db.close();
+  }
+
+  cout << endl << "Test: active list rebuilt from list and history" << endl;
+  system("ls test_db/lists/2");
+  std::remove("test_db/lists/2/active");
+  if (! db.open()) {
+    vector<const DbData*> nodes;
+    db.getList("file://client3", "/home/user", "", nodes);
+    for (vector<const DbData*>::iterator j = nodes.begin(); j != nodes.end();
+        j++) {
+      cout << " " << (*j)->type() << " " << (*j)->name() << endl;
+    }
+    db.close();
+  }
+  system("ls test_db/lists/2");
+
+  cout << endl << "Test: single list split into partitions" << endl;
+  DbTest legacy("test_db/legacy");
+  mkdir("test_db/legacy", 0755);
+  List single("test_db/legacy", "list");
+  if (! single.open("w")) {
+    single.added("file://client1", "/home/user/a", &dir);
+    single.added("file://client2", "/home/user/b", &dir);
+    single.added("file://client3", "/home/user/c", &dir);
+    single.close();
+  }
+  if (! legacy.open()) {
+    vector<const DbData*> nodes;
+    legacy.getList("file://client3", "/home/user", "", nodes);
+    for (DbList::iterator i = ((DbList*)legacy.active())->begin();
+        i != ((DbList*)legacy.active())->end(); i++) {
+      // Owner depends on who runs the test
+      cout << i->prefix() << "\t" << i->path() << "\t" << i->type() << "\t"
+        << oct << i->mode() << dec << endl;
+    }
+    legacy.close();
+  }
+  system("cat test_db/legacy/lists/index");
+  system("ls test_db/legacy");
+
+  cout << endl << "Test: snapshots" << endl;
+  time_t before = time(NULL);
+  if (! db.open()) {
+    db.add("file://client3", "/home/user", "testdir", "test1", &file,
+      "59ca0efa9f5633cb0371bbc0355478d8-0");
+    db.remove("file://client3", "/home/user", "", "testfile");
+    db.close();
+  }
+  time_t after = time(NULL);
+  if (! db.open()) {
+    time_t dates[] = { 0, before, after };
+    for (int i = 0; i < 3; i++) {
+      vector<const DbData*> nodes;
+      db.getSnapshot("file://client3", dates[i], nodes);
+      cout << "At " << ((i == 0) ? "start" : (i == 1) ? "before" : "after")
+        << ": " << nodes.size() << " element(s)" << endl;
+      for (vector<const DbData*>::iterator j = nodes.begin(); j != nodes.end();
+          j++) {
+        char buffer[DbData::checksum_size];
+        cout << " " << (*j)->type() << " " << (*j)->path() << " "
+          << (*j)->checksum(buffer) << endl;
+      }
+    }
+    db.close();
+  }
 return 0;
 
   /* Re-open database => no change */
@@ -220,23 +334,22 @@ return 0;
   }
 
   cout << "List select test" << endl;
-  list<Node*> select_list;
+  vector<const DbData*> select_list;
   db.getList("prefix", "base_path", "rel_path", select_list);
   cout << "Got " << select_list.size() << " elements" << endl;
   if (select_list.size() != 0) {
-    for (list<Node*>::iterator i = select_list.begin(); i != select_list.end();
-        i++) {
+    for (vector<const DbData*>::iterator i = select_list.begin();
+        i != select_list.end(); i++) {
       cout << "Name: " << (*i)->name() << endl;
-      delete *i;
     }
   }
+  select_list.clear();
   db.getList("file://host", "/home/user", "cvs", select_list);
   cout << "Got " << select_list.size() << " elements" << endl;
   if (select_list.size() != 0) {
-    for (list<Node*>::iterator i = select_list.begin(); i != select_list.end();
-        i++) {
+    for (vector<const DbData*>::iterator i = select_list.begin();
+        i != select_list.end(); i++) {
       cout << "Name: " << (*i)->name() << endl;
-      delete *i;
     }
   }
 
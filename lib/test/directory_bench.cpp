@@ -0,0 +1,115 @@
+/*
+     Copyright (C) 2006-2007  Herve Fache
+
+     This program is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License version 2 as
+     published by the Free Software Foundation.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program; if not, write to the Free Software
+     Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+// Listing time for a large directory, one or several lstat calls at once,
+// compared to sorting by insertion
+// Usage: directory_bench [entries]
+
+#include <iostream>
+#include <list>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+using namespace std;
+
+#include "strings.h"
+#include "files.h"
+#include "hbackup.h"
+
+using namespace hbackup;
+
+int hbackup::verbosity(void) {
+  return 0;
+}
+
+int hbackup::terminating(void) {
+  return 0;
+}
+
+// Beyond this, sorting by insertion takes too long to be worth measuring
+static const int max_insertions = 20000;
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char* argv[]) {
+  int entries = 100000;
+  if (argc > 1) {
+    entries = atoi(argv[1]);
+  }
+  if (entries <= 0) {
+    cerr << "Usage: " << argv[0] << " [entries]" << endl;
+    return 1;
+  }
+
+  // Names in an order unrelated to the sorted one
+  const char* dir_path = "test_db/bench_dir";
+  system("rm -rf test_db/bench_dir");
+  mkdir("test_db", 0755);
+  mkdir(dir_path, 0755);
+  for (int i = 0; i < entries; i++) {
+    char name[64];
+    sprintf(name, "%s/file%08x", dir_path, (i * 2654435761U) % 0xffffffffU);
+    int fd = open(name, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) {
+      cerr << strerror(errno) << ": " << name << endl;
+      return 1;
+    }
+    close(fd);
+  }
+
+  Directory dir(dir_path);
+  double start = now();
+  dir.createList(dir_path);
+  double time = now() - start;
+  printf("list     %10.0f entries/s (%.3f s, %u entries)\n", entries / time,
+    time, (unsigned int) dir.nodesList().size());
+
+  // Several lstat calls at once, only worth it on high-latency file systems
+  Directory dir8(dir_path);
+  start = now();
+  dir8.createList(dir_path, true, 8);
+  time = now() - start;
+  printf("list x8  %10.0f entries/s (%.3f s, %u entries)\n", entries / time,
+    time, (unsigned int) dir8.nodesList().size());
+
+  // How entries were sorted before
+  if (entries <= max_insertions) {
+    list<Node*> nodes;
+    start = now();
+    for (list<Node*>::iterator g = dir.nodesList().begin();
+        g != dir.nodesList().end(); g++) {
+      list<Node*>::iterator i = nodes.begin();
+      while ((i != nodes.end()) && (*(*i) < *(*g))) {
+        i++;
+      }
+      nodes.insert(i, *g);
+    }
+    time = now() - start;
+    printf("insert   %10.0f entries/s (%.3f s, sorting only)\n",
+      entries / time, time);
+  }
+  system("rm -rf test_db/bench_dir");
+  return 0;
+}
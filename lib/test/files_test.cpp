@@ -483,6 +483,33 @@ int main(void) {
   delete readfile;
   delete writefile;
 
+  cout << endl << "Test: sparse copy" << endl;
+  // Data above is mostly zeros, left as holes
+  readfile = new Stream("test1/zcopy_dest");
+  writefile = new Stream("test2/sparse_copy");
+  if (readfile->open("r", 0) || writefile->open("w", 0)) {
+    cout << "Error opening file: " << strerror(errno) << endl;
+  } else {
+    int rc = writefile->copy(*readfile);
+    if (readfile->close()) cout << "Error closing read file" << endl;
+    if (writefile->close()) cout << "Error closing write file" << endl;
+    if (rc) {
+      cout << "Error copying file: " << strerror(errno) << endl;
+    } else {
+      struct stat64 metadata;
+      cout << "checksum in: " << readfile->checksum() << endl;
+      cout << "checksum out: " << writefile->checksum() << endl;
+      cout << "size out: " << writefile->size() << endl;
+      if (! stat64("test2/sparse_copy", &metadata)) {
+        cout << "sparse out: "
+          << (metadata.st_blocks * 512 < metadata.st_size) << endl;
+      }
+    }
+  }
+  delete readfile;
+  delete writefile;
+  remove("test2/sparse_copy");
+
 
   cout << endl << "Test: getLine" << endl;
 
@@ -790,6 +817,33 @@ int main(void) {
   }
   delete d;
 
+  cout << endl << "Sorted directory test" << endl;
+
+  // Small runs, for them to be merged
+  d = new Directory("test1");
+  SortedDirectory* s = new SortedDirectory(".", 2);
+  if (! d->createList("", false) && ! s->open("test1")) {
+    list<Node*>::iterator i = d->nodesList().begin();
+    Node* node;
+    while ((node = s->next()) != NULL) {
+      cout << " " << node->type() << " " << node->name();
+      if ((i == d->nodesList().end()) || (*node != **i)) {
+        cout << " (differs from list)";
+      } else {
+        i++;
+      }
+      cout << endl;
+      delete node;
+    }
+    if (i != d->nodesList().end()) {
+      cout << "Entries missing" << endl;
+    }
+  } else {
+    cerr << "Failed to create list: " << strerror(errno) << endl;
+  }
+  delete s;
+  delete d;
+
   cout << endl << "Difference test" << endl;
 
   Node* f1 = new Node("some_name", 'f', 1, 2, 3, 4, 5);
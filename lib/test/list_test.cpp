@@ -17,6 +17,8 @@
 */
 
 #include <iostream>
+#include <list>
+#include <vector>
 #include <errno.h>
 
 using namespace std;
@@ -632,5 +634,185 @@ int main(void) {
   merge.close();
   free(line);
 
+  cout << endl << "Test: compressed list in blocks" << endl;
+
+  List blocks("test_db/blocks");
+  if (blocks.open("w", 5, 64)) {
+    cerr << "Failed to open blocks" << endl;
+    return 0;
+  }
+  node = new Link("test1/testlink");
+  for (char p = '1'; p <= '4'; p++) {
+    for (char f = 'a'; f <= 'c'; f++) {
+      char prefix_name[] = "prefix?";
+      char path_name[]   = "file_?";
+      prefix_name[6] = p;
+      path_name[5]   = f;
+      blocks.added(prefix_name, path_name, node, 0);
+    }
+  }
+  free(node);
+  node = NULL;
+  blocks.close();
+
+  blocks.open("r");
+  cout << "Blocks: " << blocks.blocks() << endl;
+  while (blocks.getEntry(&ts, &prefix, &path, &node) > 0) {
+    cout << prefix << " " << path << " " << ((Link*) node)->link() << endl;
+  }
+  blocks.close();
+
+  blocks.open("r");
+  if (! blocks.findPrefix("prefix3")) {
+    cout << "prefix 'prefix3' not found" << endl;
+  } else {
+    cout << "prefix 'prefix3' found" << endl;
+  }
+  while (blocks.getEntry(&ts, &prefix, &path, &node) > 0) {
+    cout << prefix << " " << path << endl;
+  }
+  blocks.close();
+
+  cout << endl << "Test: uncompressed list not in blocks" << endl;
+
+  List plain("test_db/plain");
+  if (plain.open("w", 0, 16)) {
+    cerr << "Failed to open plain" << endl;
+    return 0;
+  }
+  node = new File("testfile", 'f', 1000000000, 12, 1000, 1000, 0644,
+    "285b35198a5e188b3a0df3ed33f93a26-0");
+  for (char p = '1'; p <= '2'; p++) {
+    for (char f = 'a'; f <= 'c'; f++) {
+      char prefix_name[] = "prefix?";
+      char path_name[]   = "file_?";
+      prefix_name[6] = p;
+      path_name[5]   = f;
+      plain.added(prefix_name, path_name, node, 0);
+    }
+  }
+  delete node;
+  node = NULL;
+  plain.close();
+  // Same bytes as before blocks: no repeated prefix, no index
+  system("cat test_db/plain");
+  plain.open("r");
+  cout << "Blocks: " << plain.blocks() << endl;
+  plain.close();
+
+  cout << endl << "Test: list loaded in parts" << endl;
+
+  List parts("test_db/parts");
+  if (parts.open("w", 5, 64)) {
+    cerr << "Failed to open parts" << endl;
+    return 0;
+  }
+  node = new Link("test1/testlink");
+  for (int p = 1; p <= 4; p++) {
+    for (int f = 0; f < 40; f++) {
+      char prefix_name[16];
+      char path_name[16];
+      sprintf(prefix_name, "prefix%d", p);
+      sprintf(path_name, "file_%02d", f);
+      parts.added(prefix_name, path_name, node, 0);
+    }
+  }
+  free(node);
+  node = NULL;
+  parts.close();
+  parts.open("r");
+  cout << "Blocks: " << parts.blocks() << endl;
+  parts.close();
+
+  {
+    DbList serial;
+    DbList parallel;
+    if (serial.open("test_db", "parts", 1)
+     || parallel.open("test_db", "parts", 4)) {
+      cerr << "Failed to load list" << endl;
+      return 0;
+    }
+    cout << "Records: " << serial.size() << " and " << parallel.size() << endl;
+    DbList::iterator i = serial.begin();
+    DbList::iterator j = parallel.begin();
+    while ((i != serial.end()) && (j != parallel.end())) {
+      if (strcmp(i->prefix(), j->prefix()) || strcmp(i->path(), j->path())
+       || strcmp(i->link(), j->link())) {
+        break;
+      }
+      i++;
+      j++;
+    }
+    if ((i == serial.end()) && (j == parallel.end())) {
+      cout << "Same records" << endl;
+    } else {
+      cout << "Records differ" << endl;
+    }
+  }
+
+  cout << endl << "Test: journal applied to active list" << endl;
+
+  List segment("test_db/segment");
+  if (segment.open("w")) {
+    cerr << "Failed to open segment" << endl;
+    return 0;
+  }
+  node = new File("test1/testfile");
+  segment.added("prefix1", "file_0", node);
+  segment.removed("prefix2", "file_b");
+  segment.added("prefix3", "file_b", node);
+  segment.added("prefix3", "file_d", node);
+  segment.added("prefix5", "file_a", node);
+  free(node);
+  node = NULL;
+  segment.close();
+
+  DbList active;
+  if (active.open("test_db", "blocks") || active.apply("test_db", "segment")) {
+    cerr << "Failed to load active list" << endl;
+    return 0;
+  }
+  cout << "Active: " << active.size() << endl;
+  for (DbList::iterator i = active.begin(); i != active.end(); i++) {
+    cout << i->prefix() << " " << i->path() << " " << i->type()
+      << endl;
+  }
+
+  cout << endl << "Test: damaged journal record" << endl;
+
+  List damaged("test_db/damaged");
+  if (damaged.open("w")) {
+    cerr << "Failed to open journal" << endl;
+    return 0;
+  }
+  node = new File("test1/testfile");
+  damaged.added("prefix1", "file_a", node);
+  damaged.added("prefix1", "file_b", node);
+  damaged.removed("prefix1", "file_c");
+  free(node);
+  node = NULL;
+  damaged.close();
+  system("sed -i 's/file_b/file_x/' test_db/damaged");
+
+  if (damaged.open("r")) {
+    cerr << "Failed to open journal" << endl;
+    return 0;
+  }
+  int records = 0;
+  int status;
+  while ((status = damaged.getEntry(&ts, &prefix, &path, &node)) > 0) {
+    cout << prefix << " " << path << endl;
+    records++;
+  }
+  cout << "Records: " << records << ", status: " << status << " ("
+    << strerror(errno) << ")" << endl;
+  damaged.close();
+  free(prefix);
+  prefix = NULL;
+  free(path);
+  path = NULL;
+  free(node);
+  node = NULL;
+
   return 0;
 }
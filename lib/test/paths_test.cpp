@@ -20,7 +20,9 @@
 
 #include <iostream>
 #include <list>
+#include <vector>
 #include <string>
+#include <errno.h>
 
 using namespace std;
 
@@ -57,6 +59,9 @@ void showLine(time_t timestamp, char* prefix, char* path, Node* node) {
     printf(" %c %5llu %03o", node->type(), node->size(), node->mode());
     if (node->type() == 'f') {
       printf(" %s", ((File*) node)->checksum());
+      if (((File*) node)->hardLink() != NULL) {
+        printf(" => %s", ((File*) node)->hardLink());
+      }
     }
     if (node->type() == 'l') {
       printf(" %s", ((Link*) node)->link());
@@ -67,12 +72,71 @@ void showLine(time_t timestamp, char* prefix, char* path, Node* node) {
   cout << endl;
 }
 
+// Show records of a list of the partition, if any
+void showList(const char* title, const char* name) {
+  List    list("test_db/lists/0", name);
+  time_t  timestamp;
+  char*   prefix  = NULL;
+  char*   fpath   = NULL;
+  Node*   node    = NULL;
+
+  if (! File("test_db/lists/0", name).isValid()) {
+    return;
+  }
+  cout << endl << title << endl;
+  if (! list.open("r")) {
+    int rc;
+    while ((rc = list.getEntry(&timestamp, &prefix, &fpath, &node)) > 0) {
+      showLine(timestamp, prefix, fpath, node);
+    }
+    // Records are checked when read
+    if (rc < 0) {
+      cout << "Failed to read " << name << ": " << strerror(errno) << endl;
+    }
+    list.close();
+  } else {
+    cerr << "Failed to open " << name << endl;
+  }
+  free(prefix);
+  free(fpath);
+  free(node);
+}
+
+// Show records as stored: active ones, segments, history, then all versions
+void showLists() {
+  showList("List:", "active");
+  for (int i = 1; ; i++) {
+    char name[32];
+    char title[32];
+    sprintf(name, "journal.%d", i);
+    sprintf(title, "Segment %d:", i);
+    if (! File("test_db/lists/0", name).isValid()) {
+      break;
+    }
+    showList(title, name);
+  }
+  for (int i = 1; ; i++) {
+    char name[32];
+    char title[32];
+    sprintf(name, "history.%d", i);
+    sprintf(title, "History %d:", i);
+    if (! File("test_db/lists/0", name).isValid()) {
+      break;
+    }
+    showList(title, name);
+  }
+  showList("All versions:", "list");
+}
+
+// Lists are loaded on first use
+void loadList(Database& db) {
+  vector<const DbData*> nodes;
+  db.getList("file://localhost", "/home/User", "", nodes);
+}
+
 int main(void) {
   Path* path = new Path("/home/User");
   Database  db("test_db");
-  // Journal
-  List    journal("test_db", "journal~");
-  List    list("test_db", "list");
   time_t  timestamp;
   char*   prefix  = NULL;
   char*   fpath   = NULL;
@@ -82,6 +146,8 @@ int main(void) {
   my_time++;
   db.open();
 
+  loadList(db);
+
   // Display DB contents
   cout << "Active list:  " << ((DbList*)db.active())->size()
     << " element(s):\n";
@@ -103,42 +169,16 @@ int main(void) {
 
   db.close();
   // Show list contents
-  cout << endl << "List:" << endl;
-  if (! list.open("r")) {
-    while (list.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    list.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showLists();
   // Show journal contents
-  cout << endl << "Journal:" << endl;
-  if (! journal.open("r")) {
-    while (journal.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    journal.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showList("Journal:", "journal~");
 
   // Next test
   my_time++;
   db.open();
 
+  loadList(db);
+
   // Display DB contents
   cout << "Active list:  " << ((DbList*)db.active())->size()
     << " element(s):\n";
@@ -154,42 +194,16 @@ int main(void) {
 
   db.close();
   // Show list contents
-  cout << endl << "List:" << endl;
-  if (! list.open("r")) {
-    while (list.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    list.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showLists();
   // Show journal contents
-  cout << endl << "Journal:" << endl;
-  if (! journal.open("r")) {
-    while (journal.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    journal.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showList("Journal:", "journal~");
 
   // Next test
   my_time++;
   db.open();
 
+  loadList(db);
+
   // Display DB contents
   cout << "Active list:  " << ((DbList*)db.active())->size()
     << " element(s):\n";
@@ -206,42 +220,16 @@ int main(void) {
 
   db.close();
   // Show list contents
-  cout << endl << "List:" << endl;
-  if (! list.open("r")) {
-    while (list.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    list.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showLists();
   // Show journal contents
-  cout << endl << "Journal:" << endl;
-  if (! journal.open("r")) {
-    while (journal.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    journal.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showList("Journal:", "journal~");
 
   // Next test
   my_time++;
   db.open();
 
+  loadList(db);
+
   // Display DB contents
   cout << "Active list:  " << ((DbList*)db.active())->size()
     << " element(s):\n";
@@ -261,42 +249,16 @@ int main(void) {
 
   db.close();
   // Show list contents
-  cout << endl << "List:" << endl;
-  if (! list.open("r")) {
-    while (list.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    list.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showLists();
   // Show journal contents
-  cout << endl << "Journal:" << endl;
-  if (! journal.open("r")) {
-    while (journal.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    journal.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showList("Journal:", "journal~");
 
   // Next test
   my_time++;
   db.open();
 
+  loadList(db);
+
   // Display DB contents
   cout << "Active list:  " << ((DbList*)db.active())->size()
     << " element(s):\n";
@@ -316,42 +278,16 @@ int main(void) {
 
   db.close();
   // Show list contents
-  cout << endl << "List:" << endl;
-  if (! list.open("r")) {
-    while (list.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    list.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showLists();
   // Show journal contents
-  cout << endl << "Journal:" << endl;
-  if (! journal.open("r")) {
-    while (journal.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    journal.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showList("Journal:", "journal~");
 
   // Next test
   my_time++;
   db.open();
 
+  loadList(db);
+
   // Display DB contents
   cout << "Active list:  " << ((DbList*)db.active())->size()
     << " element(s):\n";
@@ -372,42 +308,16 @@ int main(void) {
 
   db.close();
   // Show list contents
-  cout << endl << "List:" << endl;
-  if (! list.open("r")) {
-    while (list.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    list.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showLists();
   // Show journal contents
-  cout << endl << "Journal:" << endl;
-  if (! journal.open("r")) {
-    while (journal.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    journal.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showList("Journal:", "journal~");
 
   // Next test
   my_time++;
   db.open();
 
+  loadList(db);
+
   // Display DB contents
   cout << "Active list:  " << ((DbList*)db.active())->size()
     << " element(s):\n";
@@ -427,42 +337,16 @@ int main(void) {
 
   db.close();
   // Show list contents
-  cout << endl << "List:" << endl;
-  if (! list.open("r")) {
-    while (list.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    list.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showLists();
   // Show journal contents
-  cout << endl << "Journal:" << endl;
-  if (! journal.open("r")) {
-    while (journal.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    journal.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showList("Journal:", "journal~");
 
   // Next test
   my_time++;
   db.open();
 
+  loadList(db);
+
   // Display DB contents
   cout << "Active list:  " << ((DbList*)db.active())->size()
     << " element(s):\n";
@@ -481,42 +365,16 @@ int main(void) {
 
   db.close();
   // Show list contents
-  cout << endl << "List:" << endl;
-  if (! list.open("r")) {
-    while (list.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    list.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showLists();
   // Show journal contents
-  cout << endl << "Journal:" << endl;
-  if (! journal.open("r")) {
-    while (journal.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    journal.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showList("Journal:", "journal~");
 
   // Next test
   my_time++;
   db.open();
 
+  loadList(db);
+
   // Display DB contents
   cout << "Active list:  " << ((DbList*)db.active())->size()
     << " element(s):\n";
@@ -532,42 +390,16 @@ int main(void) {
 
   db.close();
   // Show list contents
-  cout << endl << "List:" << endl;
-  if (! list.open("r")) {
-    while (list.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    list.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showLists();
   // Show journal contents
-  cout << endl << "Journal:" << endl;
-  if (! journal.open("r")) {
-    while (journal.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    journal.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showList("Journal:", "journal~");
 
   // Next test
   my_time++;
   db.open();
 
+  loadList(db);
+
   // Display DB contents
   cout << "Active list:  " << ((DbList*)db.active())->size()
     << " element(s):\n";
@@ -587,42 +419,16 @@ int main(void) {
 
   db.close();
   // Show list contents
-  cout << endl << "List:" << endl;
-  if (! list.open("r")) {
-    while (list.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    list.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showLists();
   // Show journal contents
-  cout << endl << "Journal:" << endl;
-  if (! journal.open("r")) {
-    while (journal.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    journal.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showList("Journal:", "journal~");
 
   // Next test
   my_time++;
   db.open();
 
+  loadList(db);
+
   // Display DB contents
   cout << "Active list:  " << ((DbList*)db.active())->size()
     << " element(s):\n";
@@ -639,42 +445,16 @@ int main(void) {
 
   db.close();
   // Show list contents
-  cout << endl << "List:" << endl;
-  if (! list.open("r")) {
-    while (list.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    list.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showLists();
   // Show journal contents
-  cout << endl << "Journal:" << endl;
-  if (! journal.open("r")) {
-    while (journal.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    journal.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showList("Journal:", "journal~");
 
   // Next test
   my_time++;
   db.open();
 
+  loadList(db);
+
   // Display DB contents
   cout << "Active list:  " << ((DbList*)db.active())->size()
     << " element(s):\n";
@@ -691,42 +471,16 @@ int main(void) {
 
   db.close();
   // Show list contents
-  cout << endl << "List:" << endl;
-  if (! list.open("r")) {
-    while (list.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    list.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showLists();
   // Show journal contents
-  cout << endl << "Journal:" << endl;
-  if (! journal.open("r")) {
-    while (journal.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    journal.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showList("Journal:", "journal~");
 
   // Next test
   my_time++;
   db.open();
 
+  loadList(db);
+
   // Display DB contents
   cout << "Active list:  " << ((DbList*)db.active())->size()
     << " element(s):\n";
@@ -737,48 +491,24 @@ int main(void) {
 
   cout << "as previous with cvs/filenew.c touched" << endl;
   system("echo blah > test1/cvs/filenew.c");
+  // Data copied ahead in disk order, same result
+  path->setLocality();
   if (! path->parse(db, "file://localhost", "test1")) {
     cout << "Parsed " << path->nodes() << " file(s)\n";
   }
 
   db.close();
   // Show list contents
-  cout << endl << "List:" << endl;
-  if (! list.open("r")) {
-    while (list.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    list.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showLists();
   // Show journal contents
-  cout << endl << "Journal:" << endl;
-  if (! journal.open("r")) {
-    while (journal.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    journal.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showList("Journal:", "journal~");
 
   // Next test
   my_time++;
   db.open();
 
+  loadList(db);
+
   // Display DB contents
   cout << "Active list:  " << ((DbList*)db.active())->size()
     << " element(s):\n";
@@ -816,42 +546,16 @@ int main(void) {
 
   db.close();
   // Show list contents
-  cout << endl << "List:" << endl;
-  if (! list.open("r")) {
-    while (list.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    list.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showLists();
   // Show journal contents
-  cout << endl << "Journal:" << endl;
-  if (! journal.open("r")) {
-    while (journal.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    journal.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showList("Journal:", "journal~");
 
   // Next test
   my_time++;
   db.open();
 
+  loadList(db);
+
   // Display DB contents
   cout << "Active list:  " << ((DbList*)db.active())->size()
     << " element(s):\n";
@@ -866,37 +570,9 @@ int main(void) {
 
   db.close();
   // Show list contents
-  cout << endl << "List:" << endl;
-  if (! list.open("r")) {
-    while (list.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    list.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showLists();
   // Show journal contents
-  cout << endl << "Journal:" << endl;
-  if (! journal.open("r")) {
-    while (journal.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    journal.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showList("Journal:", "journal~");
 
   // Next test
   my_time++;
@@ -907,6 +583,8 @@ int main(void) {
   system("rm -rf test1/testdir");
   db.open();
 
+  loadList(db);
+
   // Display DB contents
   cout << "Active list:  " << ((DbList*)db.active())->size()
     << " element(s):\n";
@@ -922,24 +600,10 @@ int main(void) {
   // NOT closing the database!
   remove("test_db/lock");
   // Show list contents
-  cout << endl << "List:" << endl;
-  if (! list.open("r")) {
-    while (list.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    list.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showLists();
   // Show journal contents
   cout << endl << "Journal:" << endl;
-  List real_journal("test_db", "journal");
+  List real_journal("test_db/lists/0", "journal");
   if (! real_journal.open("r")) {
     while (real_journal.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
       showLine(timestamp, prefix, fpath, node);
@@ -958,6 +622,8 @@ int main(void) {
   // Recover now
   db.open();
 
+  loadList(db);
+
   // Display DB contents
   cout << "Active list:  " << ((DbList*)db.active())->size()
     << " element(s):\n";
@@ -967,41 +633,45 @@ int main(void) {
   }
 
   // Show list contents
-  cout << endl << "List:" << endl;
-  if (! list.open("r")) {
-    while (list.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    list.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
-  }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+  showLists();
   // Show journal contents
-  cout << endl << "Journal:" << endl;
-  if (! journal.open("r")) {
-    while (journal.getEntry(&timestamp, &prefix, &fpath, &node) > 0) {
-      showLine(timestamp, prefix, fpath, node);
-    }
-    journal.close();
-  } else {
-    cerr << "Failed to open journal" << endl;
+  showList("Journal:", "journal~");
+  db.close();
+
+  db.open();
+
+  loadList(db);
+
+  // Display DB contents
+  cout << "Active list:  " << ((DbList*)db.active())->size()
+    << " element(s):\n";
+  for (DbList::iterator i = ((DbList*)db.active())->begin();
+       i != ((DbList*)db.active())->end(); i++) {
+    i->line();
   }
-  free(prefix);
-  prefix = NULL;
-  free(fpath);
-  fpath = NULL;
-  free(node);
-  node = NULL;
+
   db.close();
 
+  // Next test
+  my_time++;
+  cout << endl << "Hard links" << endl;
+  system("echo link > test1/hardlink");
+  system("ln test1/hardlink test1/hardlink2");
+  system("ln test1/hardlink test1/crash/hardlink");
   db.open();
 
+  if (! path->parse(db, "file://localhost", "test1")) {
+    cout << "Parsed " << path->nodes() << " file(s)\n";
+  }
+
+  db.close();
+  // Show journal contents
+  showList("Journal:", "journal~");
+
+  db.open();
+
+  loadList(db);
+
   // Display DB contents
   cout << "Active list:  " << ((DbList*)db.active())->size()
     << " element(s):\n";
@@ -0,0 +1,155 @@
+/*
+     Copyright (C) 2006-2007  Herve Fache
+
+     This program is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License version 2 as
+     published by the Free Software Foundation.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program; if not, write to the Free Software
+     Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+// Records per second for the list data line decoder, compared to sscanf
+// Usage: records_bench [records]
+
+#include <iostream>
+#include <list>
+#include <vector>
+#include <sys/time.h>
+#include <errno.h>
+
+using namespace std;
+
+#include "strings.h"
+#include "files.h"
+#include "dbdata.h"
+#include "list.h"
+#include "hbackup.h"
+
+using namespace hbackup;
+
+int hbackup::verbosity(void) {
+  return 0;
+}
+
+int hbackup::terminating(void) {
+  return 0;
+}
+
+static int decodeList(char* line, ListData& data) {
+  return List::decodeData(line, data);
+}
+
+// How lines were decoded before List::decodeData
+static int decodeScanf(char* line, ListData& data) {
+  char* start  = line;
+  int   fields = 7;
+  data.extra = NULL;
+  for (int field = 1; field <= fields; field++) {
+    char* delim = strchr(start, '\t');
+    if (delim != NULL) {
+      *delim = '\0';
+    } else
+    if (field < fields) {
+      return -1;
+    }
+    int rc = 1;
+    switch (field) {
+      case 1: rc = sscanf(start, "%ld", &data.timestamp); break;
+      case 2:
+        rc = sscanf(start, "%c", &data.type);
+        if (data.type == '-') {
+          fields = 2;
+        } else if ((data.type == 'f') || (data.type == 'l')) {
+          fields++;
+        }
+        break;
+      case 3: rc = sscanf(start, "%lld", &data.size); break;
+      case 4: rc = sscanf(start, "%ld", &data.mtime); break;
+      case 5: rc = sscanf(start, "%u", &data.uid); break;
+      case 6: rc = sscanf(start, "%u", &data.gid); break;
+      case 7: rc = sscanf(start, "%o", &data.mode); break;
+      case 8: data.extra = start;
+    }
+    if (rc != 1) {
+      return -1;
+    }
+    if (delim == NULL) {
+      break;
+    }
+    start = delim + 1;
+  }
+  return 0;
+}
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void run(
+    const char*   name,
+    int           (*decode)(char*, ListData&),
+    char*         lines,
+    int           length,
+    int           records) {
+  char*    copy  = (char*) malloc(length * records);
+  ListData data;
+  long long total = 0;
+
+  memcpy(copy, lines, length * records);
+  double start = now();
+  for (int i = 0; i < records; i++) {
+    if (decode(&copy[i * length], data) == 0) {
+      total += data.size;
+    }
+  }
+  double time = now() - start;
+  free(copy);
+  printf("%-8s %10.0f records/s (%.3f s, check %lld)\n", name,
+    records / time, time, total);
+}
+
+int main(int argc, char* argv[]) {
+  int records = 1000000;
+  if (argc > 1) {
+    records = atoi(argv[1]);
+  }
+  if (records <= 0) {
+    cerr << "Usage: " << argv[0] << " [records]" << endl;
+    return 1;
+  }
+
+  // Typical mix of files, links and directories, fixed length for simplicity
+  const int length = 96;
+  char* lines = (char*) calloc(records, length);
+  for (int i = 0; i < records; i++) {
+    char* line = &lines[i * length];
+    switch (i % 8) {
+      case 0:
+        sprintf(line, "%d\td\t0\t%d\t500\t100\t755", 1200000000 + i,
+          1170000000 + i);
+        break;
+      case 1:
+        sprintf(line, "%d\tl\t12\t%d\t500\t100\t777\t../lib/file%d",
+          1200000000 + i, 1170000000 + i, i);
+        break;
+      default:
+        sprintf(line, "%d\tf\t%d\t%d\t500\t100\t644\t"
+          "d41d8cd98f00b204e9800998ecf8427e-%d", 1200000000 + i, i * 37,
+          1170000000 + i, i % 3);
+    }
+  }
+  run("decode", decodeList, lines, length, records);
+  run("sscanf", decodeScanf, lines, length, records);
+  free(lines);
+  return 0;
+}
@@ -0,0 +1,233 @@
+/*
+     Copyright (C) 2006-2007  Herve Fache
+
+     This program is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License version 2 as
+     published by the Free Software Foundation.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program; if not, write to the Free Software
+     Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+// Fuzz test for the list data line decoder
+
+#include <iostream>
+#include <list>
+#include <vector>
+#include <errno.h>
+
+using namespace std;
+
+#include "strings.h"
+#include "files.h"
+#include "dbdata.h"
+#include "list.h"
+#include "hbackup.h"
+
+using namespace hbackup;
+
+int hbackup::verbosity(void) {
+  return 4;
+}
+
+int hbackup::terminating(void) {
+  return 0;
+}
+
+// Own generator, for the same sequence everywhere
+static unsigned int seed = 1;
+
+static unsigned int pick(unsigned int range) {
+  seed = seed * 1103515245 + 12345;
+  return ((seed >> 16) & 0x7fff) % range;
+}
+
+static void show(const char* line) {
+  char* copy = strdup(line);
+  ListData data;
+  cout << "'";
+  for (const char* c = line; *c != '\0'; c++) {
+    cout << ((*c == '\t') ? '|' : *c);
+  }
+  cout << "': ";
+  if (List::decodeData(copy, data)) {
+    cout << "corrupted" << endl;
+  } else {
+    printf("%ld %c", data.timestamp, data.type);
+    if (data.type != '-') {
+      printf(" %lld %ld %u %u %o", data.size, data.mtime, data.uid, data.gid,
+        data.mode);
+    }
+    if (data.extra != NULL) {
+      printf(" '%s'", data.extra);
+    }
+    if (data.hard_link != NULL) {
+      printf(" => '%s'", data.hard_link);
+    }
+    if (data.checked) {
+      printf(" check %08lx", data.check);
+    }
+    printf("\n");
+  }
+  free(copy);
+}
+
+static int encode(const ListData& data, char* line) {
+  int length = sprintf(line, "%ld\t%c", data.timestamp, data.type);
+  if (data.type != '-') {
+    length += sprintf(&line[length], "\t%lld\t%ld\t%u\t%u\t%o", data.size,
+      data.mtime, data.uid, data.gid, data.mode);
+  }
+  if (data.extra != NULL) {
+    length += sprintf(&line[length], "\t%s", data.extra);
+  }
+  if (data.hard_link != NULL) {
+    length += sprintf(&line[length], "\t%s", data.hard_link);
+  }
+  if (data.checked) {
+    length += sprintf(&line[length], "\t%08lx", data.check);
+  }
+  return length;
+}
+
+static bool same(const ListData& d1, const ListData& d2) {
+  if ((d1.timestamp != d2.timestamp) || (d1.type != d2.type)) {
+    return false;
+  }
+  if ((d1.type != '-')
+   && ((d1.size != d2.size) || (d1.mtime != d2.mtime) || (d1.uid != d2.uid)
+    || (d1.gid != d2.gid) || (d1.mode != d2.mode))) {
+    return false;
+  }
+  if ((d1.extra == NULL) != (d2.extra == NULL)) {
+    return false;
+  }
+  if ((d1.checked != d2.checked) || (d1.checked && (d1.check != d2.check))) {
+    return false;
+  }
+  if ((d1.hard_link == NULL) != (d2.hard_link == NULL)) {
+    return false;
+  }
+  if ((d1.hard_link != NULL) && (strcmp(d1.hard_link, d2.hard_link) != 0)) {
+    return false;
+  }
+  return (d1.extra == NULL) || (strcmp(d1.extra, d2.extra) == 0);
+}
+
+int main(void) {
+  cout << "Test: known lines" << endl;
+  show("0\t-");
+  show("5\t-\tignored");
+  show("5\t-\t0123abcd");
+  show("5\t-\t0123ABCD");
+  show("5\t-\t0123abcd0");
+  show("5\t-\t0123abcd\t");
+  show("3\td\t0\t1170000000\t0\t0\t755\tdeadbeef");
+  show("3\td\t0\t1170000000\t0\t0\t755");
+  show("3\tf\t1024\t1170000000\t500\t100\t644\t"
+    "d41d8cd98f00b204e9800998ecf8427e-0");
+  show("3\tf\t0\t1170000000\t500\t100\t644\t");
+  show("3\tl\t0\t-1\t4294967295\t0\t777\tlink\ttarget");
+  show("-1\tp\t0\t0\t0\t0\t600");
+  show("");
+  show("3");
+  show("3\t");
+  show("3\tdd\t0\t0\t0\t0\t755");
+  show("3\td\t0\t0\t0\t0");
+  show("3\td\t0\t0\t0\t0\t755\t");
+  show("3\td\t0\t0\t0\t0\t758");
+  show("3\td\t\t0\t0\t0\t755");
+  show("3\td\t0\t0\t-1\t0\t755");
+  show("3\td\t0\t0\t4294967296\t0\t755");
+  show("3\td\t12a\t0\t0\t0\t755");
+  show("3\td\t 1\t0\t0\t0\t755");
+  show("3\td\t-\t0\t0\t0\t755");
+  show("3\td\t1234567890123456789\t0\t0\t0\t755");
+  show("3\tf\t0\t0\t0\t0\t644");
+  show("3\tf\t1024\t1170000000\t500\t100\t644\t"
+    "d41d8cd98f00b204e9800998ecf8427e-0\t/home/file\t0123abcd");
+  show("3\tf\t1024\t1170000000\t500\t100\t644\t"
+    "d41d8cd98f00b204e9800998ecf8427e-0\t\t0123abcd");
+  show("3\tf\t1024\t1170000000\t500\t100\t644\t"
+    "d41d8cd98f00b204e9800998ecf8427e-0\t/home/file");
+  show("3\tl\t0\t0\t0\t0\t777\tlink\t/home/file\t0123abcd");
+
+  cout << endl << "Test: random lines" << endl;
+  static const char alphabet[] = "0123456789-\t\tfdl- a7";
+  static const char* samples[] = {
+    "3\tf\t1024\t1170000000\t500\t100\t644\t"
+      "d41d8cd98f00b204e9800998ecf8427e-0",
+    "12\tl\t4\t1170000000\t0\t0\t777\tlink",
+    "7\td\t0\t1170000000\t0\t0\t755",
+    "9\t-",
+    "9\t-\t0123abcd",
+    "3\tf\t0\t1170000000\t500\t100\t644\t-\tpath\t0123abcd",
+  };
+  int accepted = 0;
+  int errors   = 0;
+  for (int i = 0; i < 200000; i++) {
+    char line[256];
+    int  length;
+    if (pick(4) == 0) {
+      // Random characters
+      length = pick(40);
+      for (int j = 0; j < length; j++) {
+        line[j] = alphabet[pick(sizeof(alphabet) - 1)];
+      }
+    } else {
+      // Mutated sample
+      strcpy(line, samples[pick(6)]);
+      length = strlen(line);
+      int mutations = pick(3) + 1;
+      for (int j = 0; j < mutations; j++) {
+        int pos = pick(length + 1);
+        switch (pick(3)) {
+          case 0:   // replace
+            if (pos < length) {
+              line[pos] = alphabet[pick(sizeof(alphabet) - 1)];
+            }
+            break;
+          case 1:   // remove
+            if (pos < length) {
+              memmove(&line[pos], &line[pos + 1], length - pos);
+              length--;
+            }
+            break;
+          default:  // insert
+            memmove(&line[pos + 1], &line[pos], length - pos);
+            line[pos] = alphabet[pick(sizeof(alphabet) - 1)];
+            length++;
+        }
+      }
+    }
+    line[length] = '\0';
+
+    // Decoded data must survive encoding and decoding again
+    char     copy[256];
+    ListData data;
+    strcpy(copy, line);
+    if (List::decodeData(copy, data)) {
+      continue;
+    }
+    accepted++;
+    char     encoded[512];
+    ListData data2;
+    encode(data, encoded);
+    char     encoded_copy[512];
+    strcpy(encoded_copy, encoded);
+    if (List::decodeData(encoded_copy, data2) || ! same(data, data2)) {
+      errors++;
+      cout << "Mismatch for: ";
+      show(line);
+    }
+  }
+  cout << "Lines accepted: " << accepted << ", errors: " << errors << endl;
+  return 0;
+}
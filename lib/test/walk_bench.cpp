@@ -0,0 +1,157 @@
+/*
+     Copyright (C) 2006-2007  Herve Fache
+
+     This program is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License version 2 as
+     published by the Free Software Foundation.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program; if not, write to the Free Software
+     Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+// Walk time for a tree of small directories, lstat calls made slow as on a
+// file server, one or several at once
+// Usage: walk_bench [directories [entries [latency_us]]]
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <vector>
+#include <string>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+
+using namespace std;
+
+#include "strings.h"
+#include "files.h"
+#include "filters.h"
+#include "parsers.h"
+#include "dbdata.h"
+#include "list.h"
+#include "db.h"
+#include "paths.h"
+#include "hbackup.h"
+
+using namespace hbackup;
+
+int hbackup::verbosity(void) {
+  return 0;
+}
+
+int hbackup::terminating(void) {
+  return 0;
+}
+
+static int             latency   = 2000;
+static int             in_flight = 0;
+static int             most      = 0;
+static int             calls     = 0;
+static pthread_mutex_t mutex     = PTHREAD_MUTEX_INITIALIZER;
+
+// Listings fetch entries metadata with this one, relative to the directory:
+// slow these down, and count calls in flight
+extern "C" int fstatat64(
+    int             dir_fd,
+    const char*     name,
+    struct stat64*  metadata,
+    int             flags) throw() {
+  if (dir_fd == AT_FDCWD) {
+    return syscall(SYS_newfstatat, dir_fd, name, metadata, flags);
+  }
+  pthread_mutex_lock(&mutex);
+  calls++;
+  if (++in_flight > most) {
+    most = in_flight;
+  }
+  pthread_mutex_unlock(&mutex);
+  usleep(latency);
+  int rc = syscall(SYS_newfstatat, dir_fd, name, metadata, flags);
+  pthread_mutex_lock(&mutex);
+  in_flight--;
+  pthread_mutex_unlock(&mutex);
+  return rc;
+}
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char* argv[]) {
+  int directories = 64;
+  int entries     = 16;
+  if (argc > 1) {
+    directories = atoi(argv[1]);
+  }
+  if (argc > 2) {
+    entries = atoi(argv[2]);
+  }
+  if (argc > 3) {
+    latency = atoi(argv[3]);
+  }
+  if ((directories <= 0) || (entries <= 0) || (latency < 0)) {
+    cerr << "Usage: " << argv[0] << " [directories [entries [latency_us]]]"
+      << endl;
+    return 1;
+  }
+
+  const char* tree_path = "test_db/bench_tree";
+  system("rm -rf test_db/bench_tree test_db/bench_db");
+  mkdir("test_db", 0755);
+  mkdir(tree_path, 0755);
+  for (int d = 0; d < directories; d++) {
+    char name[64];
+    sprintf(name, "%s/dir%04d", tree_path, d);
+    mkdir(name, 0755);
+    for (int i = 0; i < entries; i++) {
+      sprintf(name, "%s/dir%04d/file%04d", tree_path, d, i);
+      int fd = open(name, O_WRONLY | O_CREAT, 0644);
+      if (fd < 0) {
+        cerr << strerror(errno) << ": " << name << endl;
+        return 1;
+      }
+      close(fd);
+    }
+  }
+
+  // Small directories only get one lstat at a time each, so several of them
+  // must be listed at once to keep the file server busy
+  int concurrencies[] = { 1, Path::default_concurrency };
+  for (int c = 0; c < 2; c++) {
+    system("rm -rf test_db/bench_db");
+    mkdir("test_db/bench_db", 0755);
+    Database db("test_db/bench_db");
+    Path     path("/bench");
+    path.setConcurrency(concurrencies[c]);
+    if (db.open()) {
+      cerr << "Failed to open database" << endl;
+      return 1;
+    }
+    calls = 0;
+    most  = 0;
+    double start = now();
+    path.parse(db, "file://localhost", tree_path);
+    double time = now() - start;
+    db.close();
+    printf("walk x%d %10.0f lstat/s (%.3f s, %d lstat, up to %d at once)\n",
+      concurrencies[c], calls / time, time, calls, most);
+  }
+  system("rm -rf test_db/bench_tree test_db/bench_db");
+  return 0;
+}